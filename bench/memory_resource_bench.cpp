@@ -0,0 +1,316 @@
+// Copyright (c) 2018 Mário Feroldi
+//
+// Distributed under the Boost Software License, Version 1.0.
+// See accompanying file LICENSE or copy at
+// http://www.boost.org/LICENSE_1_0.txt
+
+// Benchmarks the resources in memory_resource.hpp against new/delete and the
+// standard library's <memory_resource>, through a few allocation patterns.
+// It uses Google Benchmark, and, like the headers, comes without a build
+// system. It can be built with:
+//
+//   c++ -std=c++17 -O2 -DNDEBUG -Iinclude -o memory_resource_bench
+//     bench/memory_resource_bench.cpp -lbenchmark -lpthread
+//
+// The standard library's resources are only benchmarked when it provides
+// <memory_resource>.
+
+#include "memory_resource.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define HAS_STD_PMR 1
+#else
+#define HAS_STD_PMR 0
+#endif
+
+namespace {
+
+namespace fp = feroldi::pmr;
+
+// Each configuration owns the resource under test, and tells which allocator
+// containers use with it.
+
+struct feroldi_new_delete
+{
+  template <class T>
+  using allocator = fp::polymorphic_allocator<T>;
+  static constexpr bool thread_safe = true;
+  fp::memory_resource *get() { return fp::new_delete_resource(); }
+};
+
+struct feroldi_monotonic
+{
+  template <class T>
+  using allocator = fp::polymorphic_allocator<T>;
+  static constexpr bool thread_safe = false;
+  fp::monotonic_buffer_resource res;
+  fp::memory_resource *get() { return &res; }
+};
+
+struct feroldi_unsynchronized_pool
+{
+  template <class T>
+  using allocator = fp::polymorphic_allocator<T>;
+  static constexpr bool thread_safe = false;
+  fp::unsynchronized_pool_resource res;
+  fp::memory_resource *get() { return &res; }
+};
+
+struct feroldi_synchronized_pool
+{
+  template <class T>
+  using allocator = fp::polymorphic_allocator<T>;
+  static constexpr bool thread_safe = true;
+  fp::synchronized_pool_resource res;
+  fp::memory_resource *get() { return &res; }
+};
+
+#if HAS_STD_PMR
+struct std_new_delete
+{
+  template <class T>
+  using allocator = std::pmr::polymorphic_allocator<T>;
+  static constexpr bool thread_safe = true;
+  std::pmr::memory_resource *get() { return std::pmr::new_delete_resource(); }
+};
+
+struct std_monotonic
+{
+  template <class T>
+  using allocator = std::pmr::polymorphic_allocator<T>;
+  static constexpr bool thread_safe = false;
+  std::pmr::monotonic_buffer_resource res;
+  std::pmr::memory_resource *get() { return &res; }
+};
+
+struct std_unsynchronized_pool
+{
+  template <class T>
+  using allocator = std::pmr::polymorphic_allocator<T>;
+  static constexpr bool thread_safe = false;
+  std::pmr::unsynchronized_pool_resource res;
+  std::pmr::memory_resource *get() { return &res; }
+};
+
+struct std_synchronized_pool
+{
+  template <class T>
+  using allocator = std::pmr::polymorphic_allocator<T>;
+  static constexpr bool thread_safe = true;
+  std::pmr::synchronized_pool_resource res;
+  std::pmr::memory_resource *get() { return &res; }
+};
+#endif
+
+// Grows a vector one element at a time.
+template <class Config>
+void vector_push_back(benchmark::State &state)
+{
+  const auto n = static_cast<int>(state.range(0));
+  for (auto _ : state)
+  {
+    Config config;
+    using allocator = typename Config::template allocator<int>;
+    std::vector<int, allocator> v{allocator(config.get())};
+    for (int i = 0; i < n; ++i)
+      v.push_back(i);
+    benchmark::DoNotOptimize(v.data());
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+// Inserts random keys in a map, erases half of them, then inserts again, so
+// that freed nodes get reused.
+template <class Config>
+void map_insert_erase(benchmark::State &state)
+{
+  const auto n = static_cast<int>(state.range(0));
+  std::vector<int> keys(static_cast<std::size_t>(n));
+  std::mt19937 rng(42);
+  for (auto &k : keys)
+    k = static_cast<int>(rng());
+
+  for (auto _ : state)
+  {
+    Config config;
+    using allocator =
+      typename Config::template allocator<std::pair<const int, int>>;
+    std::map<int, int, std::less<int>, allocator> m{allocator(config.get())};
+    for (auto k : keys)
+      m.emplace(k, k);
+    for (std::size_t i = 0; i < keys.size(); i += 2)
+      m.erase(keys[i]);
+    for (std::size_t i = 0; i < keys.size(); i += 2)
+      m.emplace(keys[i], 0);
+    benchmark::DoNotOptimize(m.size());
+  }
+  state.SetItemsProcessed(state.iterations() * n * 2);
+}
+
+// Splits a text in words, each stored in a string long enough to allocate.
+template <class Config>
+void string_parsing(benchmark::State &state)
+{
+  const auto n = static_cast<int>(state.range(0));
+  std::string text;
+  std::mt19937 rng(42);
+  for (int i = 0; i < n; ++i)
+  {
+    text.append(16 + rng() % 48, static_cast<char>('a' + rng() % 26));
+    text.push_back(' ');
+  }
+
+  for (auto _ : state)
+  {
+    Config config;
+    using string =
+      std::basic_string<char, std::char_traits<char>,
+                        typename Config::template allocator<char>>;
+    using allocator = typename Config::template allocator<string>;
+    std::vector<string, allocator> words{allocator(config.get())};
+
+    std::size_t begin = 0;
+    while (begin < text.size())
+    {
+      const auto end = text.find(' ', begin);
+      words.emplace_back(text.data() + begin, end - begin);
+      begin = end + 1;
+    }
+    benchmark::DoNotOptimize(words.data());
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+// A producer thread allocates blocks, and a consumer thread frees them.
+template <class Config>
+void producer_consumer(benchmark::State &state)
+{
+  const auto n = static_cast<std::size_t>(state.range(0));
+  constexpr std::size_t block_size = 64;
+
+  for (auto _ : state)
+  {
+    Config config;
+    const auto res = config.get();
+
+    // Single-producer single-consumer ring of allocated blocks.
+    std::vector<std::atomic<void *>> ring(1024);
+    std::thread consumer([&] {
+      std::size_t tail = 0;
+      for (std::size_t i = 0; i < n; ++i)
+      {
+        auto &slot = ring[tail++ % ring.size()];
+        void *p;
+        while (!(p = slot.load(std::memory_order_acquire)))
+          std::this_thread::yield();
+        slot.store(nullptr, std::memory_order_relaxed);
+        res->deallocate(p, block_size);
+      }
+    });
+
+    std::size_t head = 0;
+    for (std::size_t i = 0; i < n; ++i)
+    {
+      auto &slot = ring[head++ % ring.size()];
+      while (slot.load(std::memory_order_relaxed))
+        std::this_thread::yield();
+      slot.store(res->allocate(block_size), std::memory_order_release);
+    }
+    consumer.join();
+  }
+  state.SetItemsProcessed(state.iterations() * static_cast<std::int64_t>(n));
+}
+
+// Every thread allocates and frees blocks of random sizes from one shared
+// resource. The resource outlives every run, as threads may still be freeing
+// their blocks after the others have returned.
+template <class Config>
+void multithreaded_scaling(benchmark::State &state)
+{
+  static Config config;
+
+  constexpr std::size_t live_blocks = 256;
+  std::vector<std::pair<void *, std::size_t>> blocks(live_blocks);
+  std::mt19937 rng(static_cast<unsigned>(state.thread_index()));
+  std::size_t i = 0;
+
+  for (auto _ : state)
+  {
+    auto &block = blocks[i++ % live_blocks];
+    if (block.first)
+      config.get()->deallocate(block.first, block.second);
+    block.second = 16 + rng() % 240;
+    block.first = config.get()->allocate(block.second);
+  }
+
+  for (auto &block : blocks)
+    if (block.first)
+      config.get()->deallocate(block.first, block.second);
+
+  state.SetItemsProcessed(state.iterations());
+}
+
+template <class Config>
+void register_benchmarks(const std::string &name)
+{
+  benchmark::RegisterBenchmark(("vector_push_back/" + name).c_str(),
+                               vector_push_back<Config>)
+    ->Arg(1 << 16);
+  benchmark::RegisterBenchmark(("map_insert_erase/" + name).c_str(),
+                               map_insert_erase<Config>)
+    ->Arg(1 << 14);
+  benchmark::RegisterBenchmark(("string_parsing/" + name).c_str(),
+                               string_parsing<Config>)
+    ->Arg(1 << 14);
+
+  if constexpr (Config::thread_safe)
+  {
+    benchmark::RegisterBenchmark(("producer_consumer/" + name).c_str(),
+                                 producer_consumer<Config>)
+      ->Arg(1 << 16)
+      ->UseRealTime();
+
+    const auto max_threads =
+      static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    benchmark::RegisterBenchmark(("multithreaded_scaling/" + name).c_str(),
+                                 multithreaded_scaling<Config>)
+      ->ThreadRange(1, max_threads)
+      ->UseRealTime();
+  }
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+  register_benchmarks<feroldi_new_delete>("feroldi_new_delete");
+  register_benchmarks<feroldi_monotonic>("feroldi_monotonic");
+  register_benchmarks<feroldi_unsynchronized_pool>(
+    "feroldi_unsynchronized_pool");
+  register_benchmarks<feroldi_synchronized_pool>("feroldi_synchronized_pool");
+#if HAS_STD_PMR
+  register_benchmarks<std_new_delete>("std_new_delete");
+  register_benchmarks<std_monotonic>("std_monotonic");
+  register_benchmarks<std_unsynchronized_pool>("std_unsynchronized_pool");
+  register_benchmarks<std_synchronized_pool>("std_synchronized_pool");
+#endif
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    return 1;
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+}
@@ -0,0 +1,87 @@
+// Copyright (c) 2018 Mário Feroldi
+//
+// Distributed under the Boost Software License, Version 1.0.
+// See accompanying file LICENSE or copy at
+// http://www.boost.org/LICENSE_1_0.txt
+
+#ifndef FEROLDI_CXX17_CONTAINERS
+#define FEROLDI_CXX17_CONTAINERS
+
+#include "memory_resource.hpp"
+
+#include <deque>
+#include <forward_list>
+#include <functional>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// The aliases of the standard containers that C++17 declares in namespace
+// std::pmr, with this library's polymorphic_allocator, for toolchains which
+// don't have them.
+
+namespace feroldi::pmr {
+
+template <class T>
+using deque = std::deque<T, polymorphic_allocator<T>>;
+
+template <class T>
+using forward_list = std::forward_list<T, polymorphic_allocator<T>>;
+
+template <class T>
+using list = std::list<T, polymorphic_allocator<T>>;
+
+template <class T>
+using vector = std::vector<T, polymorphic_allocator<T>>;
+
+template <class Key, class T, class Compare = std::less<Key>>
+using map =
+  std::map<Key, T, Compare, polymorphic_allocator<std::pair<const Key, T>>>;
+
+template <class Key, class T, class Compare = std::less<Key>>
+using multimap = std::multimap<Key, T, Compare,
+                               polymorphic_allocator<std::pair<const Key, T>>>;
+
+template <class Key, class Compare = std::less<Key>>
+using set = std::set<Key, Compare, polymorphic_allocator<Key>>;
+
+template <class Key, class Compare = std::less<Key>>
+using multiset = std::multiset<Key, Compare, polymorphic_allocator<Key>>;
+
+template <class Key, class T, class Hash = std::hash<Key>,
+          class Pred = std::equal_to<Key>>
+using unordered_map =
+  std::unordered_map<Key, T, Hash, Pred,
+                     polymorphic_allocator<std::pair<const Key, T>>>;
+
+template <class Key, class T, class Hash = std::hash<Key>,
+          class Pred = std::equal_to<Key>>
+using unordered_multimap =
+  std::unordered_multimap<Key, T, Hash, Pred,
+                          polymorphic_allocator<std::pair<const Key, T>>>;
+
+template <class Key, class Hash = std::hash<Key>,
+          class Pred = std::equal_to<Key>>
+using unordered_set =
+  std::unordered_set<Key, Hash, Pred, polymorphic_allocator<Key>>;
+
+template <class Key, class Hash = std::hash<Key>,
+          class Pred = std::equal_to<Key>>
+using unordered_multiset =
+  std::unordered_multiset<Key, Hash, Pred, polymorphic_allocator<Key>>;
+
+template <class CharT, class Traits = std::char_traits<CharT>>
+using basic_string =
+  std::basic_string<CharT, Traits, polymorphic_allocator<CharT>>;
+
+using string = basic_string<char>;
+using u16string = basic_string<char16_t>;
+using u32string = basic_string<char32_t>;
+using wstring = basic_string<wchar_t>;
+
+} // namespace feroldi::pmr
+#endif
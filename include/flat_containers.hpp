@@ -0,0 +1,856 @@
+// Copyright (c) 2018 Mário Feroldi
+//
+// Distributed under the Boost Software License, Version 1.0.
+// See accompanying file LICENSE or copy at
+// http://www.boost.org/LICENSE_1_0.txt
+
+#ifndef FEROLDI_CXX17_FLAT_CONTAINERS
+#define FEROLDI_CXX17_FLAT_CONTAINERS
+
+#include "memory_resource.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+// Associative containers that keep their elements sorted in a single array,
+// rather than in a node per element, so that lookups are binary searches over
+// contiguous memory, and iterating is a walk over it. Insertions and
+// erasures move the elements after them, so they suit containers that are
+// built once, or in bulk, and mostly looked up afterwards.
+
+namespace feroldi::pmr {
+
+namespace detail {
+
+// Contiguous storage for the elements of a flat container, allocated from a
+// memory resource. It grows in place with memory_resource::try_expand when
+// the resource can, as a monotonic_buffer_resource can while the storage is
+// its most recent allocation, so that building a container in an arena
+// neither moves the elements nor leaves old storage behind as waste.
+//
+// Elements are constructed with uses-allocator construction, so that those
+// which take an allocator allocate from the same resource.
+template <class T>
+class flat_storage
+{
+public:
+  explicit flat_storage(memory_resource *r) noexcept : res(r) { assert(r); }
+
+  flat_storage(flat_storage &&other) noexcept
+    : res(other.res)
+    , first(std::exchange(other.first, nullptr))
+    , count(std::exchange(other.count, 0))
+    , cap(std::exchange(other.cap, 0))
+  {}
+
+  flat_storage(const flat_storage &) = delete;
+  flat_storage &operator=(const flat_storage &) = delete;
+
+  ~flat_storage()
+  {
+    clear();
+    deallocate_storage();
+  }
+
+  memory_resource *resource() const noexcept { return res; }
+
+  T *begin() const noexcept { return first; }
+  T *end() const noexcept { return first + count; }
+  std::size_t size() const noexcept { return count; }
+  std::size_t capacity() const noexcept { return cap; }
+
+  // Storage is only swapped along with the resource it came from.
+  void swap(flat_storage &other) noexcept
+  {
+    std::swap(res, other.res);
+    std::swap(first, other.first);
+    std::swap(count, other.count);
+    std::swap(cap, other.cap);
+  }
+
+  void reserve(std::size_t n)
+  {
+    if (n > cap && !expand(n))
+      reallocate_insert(n, count, no_element());
+  }
+
+  void clear() noexcept
+  {
+    std::destroy(begin(), end());
+    count = 0;
+  }
+
+  // Constructs an element from `args` at `pos`, moving the ones after it up,
+  // and returns it. `args` may refer to elements, as the element is
+  // constructed before any is moved.
+  template <class... Args>
+  T *emplace(T *pos, Args &&... args)
+  {
+    const auto index = static_cast<std::size_t>(pos - first);
+    assert(index <= count);
+    if (count == cap && !expand(grown_capacity(count + 1)))
+      return reallocate_insert(grown_capacity(count + 1), index,
+                               std::forward<Args>(args)...);
+
+    polymorphic_allocator<T>(res).construct(end(),
+                                            std::forward<Args>(args)...);
+    ++count;
+    std::rotate(first + index, end() - 1, end());
+    return first + index;
+  }
+
+  // Erases the elements in `[from, to)`, and returns where they were.
+  T *erase(T *from, T *to)
+  {
+    if (from != to)
+    {
+      const auto new_end = std::move(to, end(), from);
+      std::destroy(new_end, end());
+      count = static_cast<std::size_t>(new_end - first);
+    }
+    return from;
+  }
+
+private:
+  // Given to reallocate_insert() for it to insert nothing.
+  struct no_element
+  {
+  };
+
+  std::size_t grown_capacity(std::size_t min_size) const noexcept
+  {
+    return std::max({min_size, cap * 2, std::size_t(4)});
+  }
+
+  // Grows the storage to `n` elements in place, if the resource can.
+  bool expand(std::size_t n) noexcept
+  {
+    if (!first || !res->try_expand(first, cap * sizeof(T), n * sizeof(T)))
+      return false;
+    cap = n;
+    return true;
+  }
+
+  // Moves the elements to new storage of `n` elements, with one constructed
+  // from `args` at `index` in between, unless `args` is a `no_element`. The
+  // element is constructed first, as `args` may refer to one.
+  template <class... Args>
+  T *reallocate_insert(std::size_t n, std::size_t index, Args &&... args)
+  {
+    constexpr bool inserts =
+      !std::is_same_v<std::tuple<std::decay_t<Args>...>,
+                      std::tuple<no_element>>;
+    const std::size_t gap = inserts ? 1 : 0;
+    if (n > std::numeric_limits<std::size_t>::max() / sizeof(T))
+      throw std::bad_alloc();
+
+    const auto new_first =
+      static_cast<T *>(res->allocate(n * sizeof(T), alignof(T)));
+    try
+    {
+      if constexpr (inserts)
+        polymorphic_allocator<T>(res).construct(new_first + index,
+                                                std::forward<Args>(args)...);
+      try
+      {
+        relocate(first, first + index, new_first);
+        try
+        {
+          relocate(first + index, end(), new_first + index + gap);
+        }
+        catch (...)
+        {
+          std::destroy(new_first, new_first + index);
+          throw;
+        }
+      }
+      catch (...)
+      {
+        if constexpr (inserts)
+          std::destroy_at(new_first + index);
+        throw;
+      }
+    }
+    catch (...)
+    {
+      res->deallocate(new_first, n * sizeof(T), alignof(T));
+      throw;
+    }
+
+    std::destroy(begin(), end());
+    deallocate_storage();
+    first = new_first;
+    count += gap;
+    cap = n;
+    return first + index;
+  }
+
+  // Constructs the elements of `[from, to)` at `out`, by moving them unless
+  // moving may throw and copying is possible.
+  static void relocate(T *from, T *to, T *out)
+  {
+    if constexpr (std::is_nothrow_move_constructible_v<T> ||
+                  !std::is_copy_constructible_v<T>)
+      std::uninitialized_move(from, to, out);
+    else
+      std::uninitialized_copy(from, to, out);
+  }
+
+  void deallocate_storage() noexcept
+  {
+    if (first)
+      res->deallocate(first, cap * sizeof(T), alignof(T));
+    first = nullptr;
+    cap = 0;
+  }
+
+  memory_resource *res;
+  T *first = nullptr;
+  std::size_t count = 0;
+  std::size_t cap = 0;
+};
+
+// An object constructed with uses-allocator construction from a resource,
+// for elements that are built before where they go is known.
+template <class T>
+class resource_constructed
+{
+public:
+  template <class... Args>
+  explicit resource_constructed(memory_resource *r, Args &&... args)
+  {
+    polymorphic_allocator<T>(r).construct(get(), std::forward<Args>(args)...);
+  }
+
+  resource_constructed(const resource_constructed &) = delete;
+  resource_constructed &operator=(const resource_constructed &) = delete;
+
+  ~resource_constructed() { std::destroy_at(get()); }
+
+  T *get() noexcept { return std::launder(reinterpret_cast<T *>(storage)); }
+
+private:
+  alignas(T) unsigned char storage[sizeof(T)];
+};
+
+// What flat_map and flat_set have in common: a sorted array of unique
+// `Value`s, ordered by the keys `KeyOf` gets out of them.
+template <class Value, class Key, class KeyOf, class Compare, class Iterator>
+class flat_tree
+{
+public:
+  using key_type = Key;
+  using value_type = Value;
+  using size_type = std::size_t;
+  using difference_type = std::ptrdiff_t;
+  using key_compare = Compare;
+  using allocator_type = polymorphic_allocator<Value>;
+  using reference = value_type &;
+  using const_reference = const value_type &;
+  using pointer = value_type *;
+  using const_pointer = const value_type *;
+  using iterator = Iterator;
+  using const_iterator = const Value *;
+  using reverse_iterator = std::reverse_iterator<iterator>;
+  using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+  flat_tree(const Compare &comp, const allocator_type &alloc)
+    : comp(comp), storage(alloc.resource())
+  {}
+
+  // Copies use the same resource, unless given another.
+  flat_tree(const flat_tree &other)
+    : flat_tree(other, other.get_allocator())
+  {}
+
+  flat_tree(const flat_tree &other, const allocator_type &alloc)
+    : comp(other.comp), storage(alloc.resource())
+  {
+    storage.reserve(other.size());
+    for (const auto &value : other)
+      storage.emplace(storage.end(), value);
+  }
+
+  flat_tree(flat_tree &&other) noexcept
+    : comp(other.comp), storage(std::move(other.storage))
+  {}
+
+  // Storage is only taken from `other` if both use the same resource.
+  flat_tree(flat_tree &&other, const allocator_type &alloc)
+    : comp(other.comp), storage(alloc.resource())
+  {
+    if (*storage.resource() == *other.storage.resource())
+      storage.swap(other.storage);
+    else
+      append_moved(other);
+  }
+
+  flat_tree &operator=(const flat_tree &other)
+  {
+    if (this != &other)
+    {
+      clear();
+      comp = other.comp;
+      storage.reserve(other.size());
+      for (const auto &value : other)
+        storage.emplace(storage.end(), value);
+    }
+    return *this;
+  }
+
+  flat_tree &operator=(flat_tree &&other)
+  {
+    if (this == &other)
+      return *this;
+    clear();
+    comp = other.comp;
+    if (*storage.resource() == *other.storage.resource())
+      storage.swap(other.storage);
+    else
+      append_moved(other);
+    return *this;
+  }
+
+  allocator_type get_allocator() const noexcept { return storage.resource(); }
+  memory_resource *resource() const noexcept { return storage.resource(); }
+  key_compare key_comp() const { return comp; }
+
+  iterator begin() noexcept { return storage.begin(); }
+  const_iterator begin() const noexcept { return storage.begin(); }
+  const_iterator cbegin() const noexcept { return storage.begin(); }
+  iterator end() noexcept { return storage.end(); }
+  const_iterator end() const noexcept { return storage.end(); }
+  const_iterator cend() const noexcept { return storage.end(); }
+  reverse_iterator rbegin() noexcept { return reverse_iterator(end()); }
+  const_reverse_iterator rbegin() const noexcept
+  {
+    return const_reverse_iterator(end());
+  }
+  reverse_iterator rend() noexcept { return reverse_iterator(begin()); }
+  const_reverse_iterator rend() const noexcept
+  {
+    return const_reverse_iterator(begin());
+  }
+
+  bool empty() const noexcept { return storage.size() == 0; }
+  size_type size() const noexcept { return storage.size(); }
+  size_type capacity() const noexcept { return storage.capacity(); }
+  void reserve(size_type n) { storage.reserve(n); }
+  void clear() noexcept { storage.clear(); }
+
+  iterator lower_bound(const Key &key) { return lower_bound_of(key); }
+  const_iterator lower_bound(const Key &key) const
+  {
+    return lower_bound_of(key);
+  }
+
+  iterator upper_bound(const Key &key) { return upper_bound_of(key); }
+  const_iterator upper_bound(const Key &key) const
+  {
+    return upper_bound_of(key);
+  }
+
+  std::pair<iterator, iterator> equal_range(const Key &key)
+  {
+    return equal_range_of(key);
+  }
+  std::pair<const_iterator, const_iterator> equal_range(const Key &key) const
+  {
+    return equal_range_of(key);
+  }
+
+  iterator find(const Key &key) { return find_of(key); }
+  const_iterator find(const Key &key) const { return find_of(key); }
+
+  size_type count(const Key &key) const { return find_of(key) != end(); }
+  bool contains(const Key &key) const { return find_of(key) != end(); }
+
+  // Lookups by keys of other types, which are only available if the
+  // comparison is transparent, such as std::less<>.
+  template <class K, class C = Compare, class = typename C::is_transparent>
+  iterator lower_bound(const K &key)
+  {
+    return lower_bound_of(key);
+  }
+
+  template <class K, class C = Compare, class = typename C::is_transparent>
+  const_iterator lower_bound(const K &key) const
+  {
+    return lower_bound_of(key);
+  }
+
+  template <class K, class C = Compare, class = typename C::is_transparent>
+  iterator upper_bound(const K &key)
+  {
+    return upper_bound_of(key);
+  }
+
+  template <class K, class C = Compare, class = typename C::is_transparent>
+  const_iterator upper_bound(const K &key) const
+  {
+    return upper_bound_of(key);
+  }
+
+  template <class K, class C = Compare, class = typename C::is_transparent>
+  std::pair<iterator, iterator> equal_range(const K &key)
+  {
+    return equal_range_of(key);
+  }
+
+  template <class K, class C = Compare, class = typename C::is_transparent>
+  std::pair<const_iterator, const_iterator> equal_range(const K &key) const
+  {
+    return equal_range_of(key);
+  }
+
+  template <class K, class C = Compare, class = typename C::is_transparent>
+  iterator find(const K &key)
+  {
+    return find_of(key);
+  }
+
+  template <class K, class C = Compare, class = typename C::is_transparent>
+  const_iterator find(const K &key) const
+  {
+    return find_of(key);
+  }
+
+  template <class K, class C = Compare, class = typename C::is_transparent>
+  size_type count(const K &key) const
+  {
+    return find_of(key) != end();
+  }
+
+  template <class K, class C = Compare, class = typename C::is_transparent>
+  bool contains(const K &key) const
+  {
+    return find_of(key) != end();
+  }
+
+  iterator erase(const_iterator pos) { return erase(pos, std::next(pos)); }
+
+  iterator erase(const_iterator first, const_iterator last)
+  {
+    return storage.erase(mutable_pointer(first), mutable_pointer(last));
+  }
+
+  size_type erase(const Key &key)
+  {
+    const auto it = find_of(key);
+    if (it == end())
+      return 0;
+    erase(it);
+    return 1;
+  }
+
+  void swap(flat_tree &other) noexcept
+  {
+    using std::swap;
+    swap(comp, other.comp);
+    storage.swap(other.storage);
+  }
+
+  friend bool operator==(const flat_tree &a, const flat_tree &b)
+  {
+    return std::equal(a.begin(), a.end(), b.begin(), b.end());
+  }
+
+  friend bool operator!=(const flat_tree &a, const flat_tree &b)
+  {
+    return !(a == b);
+  }
+
+protected:
+  // Inserts an element made from `args`, unless there's one with `key`.
+  template <class K, class... Args>
+  std::pair<iterator, bool> emplace_key(const K &key, Args &&... args)
+  {
+    const auto it = lower_bound_of(key);
+    if (it != storage.end() && !comp(key, KeyOf()(*it)))
+      return {it, false};
+    return {storage.emplace(it, std::forward<Args>(args)...), true};
+  }
+
+  // Inserts an element made from `args`, whose key can't be told without
+  // constructing it.
+  template <class... Args>
+  std::pair<iterator, bool> emplace_value(Args &&... args)
+  {
+    resource_constructed<Value> value(resource(),
+                                      std::forward<Args>(args)...);
+    return emplace_key(KeyOf()(*value.get()), std::move(*value.get()));
+  }
+
+  // Inserts the elements of `[first, last)` whose keys aren't in the
+  // container yet. They're appended, sorted and merged with the others all
+  // at once, rather than inserted one by one. Of equivalent elements, the
+  // first one is kept. If appending or sorting them throws, the container is
+  // left as it was.
+  //
+  // std::stable_sort and std::inplace_merge get their scratch buffers from
+  // the global operator new, not from the container's resource.
+  template <class InputIt>
+  void insert_range(InputIt first, InputIt last)
+  {
+    const auto old_size = size();
+    if constexpr (std::is_base_of_v<
+                    std::forward_iterator_tag,
+                    typename std::iterator_traits<InputIt>::iterator_category>)
+      storage.reserve(old_size +
+                      static_cast<size_type>(std::distance(first, last)));
+    try
+    {
+      for (; first != last; ++first)
+        storage.emplace(storage.end(), *first);
+      std::stable_sort(storage.begin() + old_size, storage.end(),
+                       value_less());
+    }
+    catch (...)
+    {
+      storage.erase(storage.begin() + old_size, storage.end());
+      throw;
+    }
+
+    const auto middle = storage.begin() + old_size;
+    std::inplace_merge(storage.begin(), middle, storage.end(), value_less());
+    const auto new_end =
+      std::unique(storage.begin(), storage.end(),
+                  [this](const Value &a, const Value &b) {
+                    return !comp(KeyOf()(a), KeyOf()(b));
+                  });
+    storage.erase(new_end, storage.end());
+  }
+
+private:
+  Value *mutable_pointer(const_iterator it) const noexcept
+  {
+    return storage.begin() + (it - storage.begin());
+  }
+
+  void append_moved(flat_tree &other)
+  {
+    storage.reserve(other.size());
+    for (auto &value : other.storage)
+      storage.emplace(storage.end(), std::move(value));
+    other.clear();
+  }
+
+  template <class K>
+  Value *lower_bound_of(const K &key) const
+  {
+    return std::lower_bound(storage.begin(), storage.end(), key,
+                            [this](const Value &a, const K &b) {
+                              return comp(KeyOf()(a), b);
+                            });
+  }
+
+  template <class K>
+  Value *upper_bound_of(const K &key) const
+  {
+    return std::upper_bound(storage.begin(), storage.end(), key,
+                            [this](const K &a, const Value &b) {
+                              return comp(a, KeyOf()(b));
+                            });
+  }
+
+  template <class K>
+  Value *find_of(const K &key) const
+  {
+    const auto it = lower_bound_of(key);
+    return it != storage.end() && !comp(key, KeyOf()(*it)) ? it
+                                                           : storage.end();
+  }
+
+  template <class K>
+  std::pair<Value *, Value *> equal_range_of(const K &key) const
+  {
+    const auto it = find_of(key);
+    return {it, it == storage.end() ? it : it + 1};
+  }
+
+  auto value_less() const
+  {
+    return [this](const Value &a, const Value &b) {
+      return comp(KeyOf()(a), KeyOf()(b));
+    };
+  }
+
+  Compare comp;
+  flat_storage<Value> storage;
+};
+
+struct pair_first
+{
+  template <class Pair>
+  const auto &operator()(const Pair &p) const noexcept
+  {
+    return p.first;
+  }
+};
+
+struct identity
+{
+  template <class T>
+  const T &operator()(const T &value) const noexcept
+  {
+    return value;
+  }
+};
+
+} // namespace detail
+
+// An associative container of unique keys and a value for each, kept sorted
+// by key in a single array, as a std::map is in a tree of nodes.
+//
+// Elements are `std::pair<Key, T>`, rather than `std::pair<const Key, T>`,
+// so that they can be moved around the array. Keys must not be changed
+// through iterators all the same. Insertions and erasures invalidate
+// iterators after where they happen, or all of them if storage grows.
+template <class Key, class T, class Compare = std::less<Key>>
+class flat_map
+  : public detail::flat_tree<std::pair<Key, T>, Key, detail::pair_first,
+                             Compare, std::pair<Key, T> *>
+{
+  using base = detail::flat_tree<std::pair<Key, T>, Key, detail::pair_first,
+                                 Compare, std::pair<Key, T> *>;
+
+public:
+  using mapped_type = T;
+  using typename base::allocator_type;
+  using typename base::iterator;
+  using typename base::value_type;
+
+  flat_map() : flat_map(Compare()) {}
+
+  explicit flat_map(const Compare &comp,
+                    const allocator_type &alloc = allocator_type())
+    : base(comp, alloc)
+  {}
+
+  explicit flat_map(const allocator_type &alloc) : flat_map(Compare(), alloc)
+  {}
+
+  template <class InputIt,
+            class = typename std::iterator_traits<InputIt>::iterator_category>
+  flat_map(InputIt first, InputIt last, const Compare &comp = Compare(),
+           const allocator_type &alloc = allocator_type())
+    : base(comp, alloc)
+  {
+    this->insert_range(first, last);
+  }
+
+  template <class InputIt,
+            class = typename std::iterator_traits<InputIt>::iterator_category>
+  flat_map(InputIt first, InputIt last, const allocator_type &alloc)
+    : flat_map(first, last, Compare(), alloc)
+  {}
+
+  flat_map(std::initializer_list<value_type> init,
+           const Compare &comp = Compare(),
+           const allocator_type &alloc = allocator_type())
+    : flat_map(init.begin(), init.end(), comp, alloc)
+  {}
+
+  flat_map(std::initializer_list<value_type> init,
+           const allocator_type &alloc)
+    : flat_map(init.begin(), init.end(), Compare(), alloc)
+  {}
+
+  flat_map(const flat_map &) = default;
+  flat_map(flat_map &&) = default;
+  flat_map(const flat_map &other, const allocator_type &alloc)
+    : base(other, alloc)
+  {}
+  flat_map(flat_map &&other, const allocator_type &alloc)
+    : base(std::move(other), alloc)
+  {}
+
+  flat_map &operator=(const flat_map &) = default;
+  flat_map &operator=(flat_map &&) = default;
+
+  T &operator[](const Key &key) { return try_emplace(key).first->second; }
+  T &operator[](Key &&key)
+  {
+    return try_emplace(std::move(key)).first->second;
+  }
+
+  T &at(const Key &key)
+  {
+    const auto it = this->find(key);
+    if (it == this->end())
+      throw std::out_of_range("flat_map::at: key not found");
+    return it->second;
+  }
+
+  const T &at(const Key &key) const
+  {
+    const auto it = this->find(key);
+    if (it == this->end())
+      throw std::out_of_range("flat_map::at: key not found");
+    return it->second;
+  }
+
+  std::pair<iterator, bool> insert(const value_type &value)
+  {
+    return this->emplace_key(value.first, value);
+  }
+
+  std::pair<iterator, bool> insert(value_type &&value)
+  {
+    return this->emplace_key(value.first, std::move(value));
+  }
+
+  template <class InputIt>
+  void insert(InputIt first, InputIt last)
+  {
+    this->insert_range(first, last);
+  }
+
+  void insert(std::initializer_list<value_type> init)
+  {
+    this->insert_range(init.begin(), init.end());
+  }
+
+  template <class... Args>
+  std::pair<iterator, bool> emplace(Args &&... args)
+  {
+    return this->emplace_value(std::forward<Args>(args)...);
+  }
+
+  template <class... Args>
+  std::pair<iterator, bool> try_emplace(const Key &key, Args &&... args)
+  {
+    return this->emplace_key(
+      key, std::piecewise_construct, std::forward_as_tuple(key),
+      std::forward_as_tuple(std::forward<Args>(args)...));
+  }
+
+  template <class... Args>
+  std::pair<iterator, bool> try_emplace(Key &&key, Args &&... args)
+  {
+    return this->emplace_key(
+      key, std::piecewise_construct, std::forward_as_tuple(std::move(key)),
+      std::forward_as_tuple(std::forward<Args>(args)...));
+  }
+
+  template <class M>
+  std::pair<iterator, bool> insert_or_assign(const Key &key, M &&obj)
+  {
+    auto result = try_emplace(key, std::forward<M>(obj));
+    if (!result.second)
+      result.first->second = std::forward<M>(obj);
+    return result;
+  }
+
+  template <class M>
+  std::pair<iterator, bool> insert_or_assign(Key &&key, M &&obj)
+  {
+    auto result = try_emplace(std::move(key), std::forward<M>(obj));
+    if (!result.second)
+      result.first->second = std::forward<M>(obj);
+    return result;
+  }
+};
+
+// An associative container of unique keys, kept sorted in a single array,
+// as a std::set is in a tree of nodes. Insertions and erasures invalidate
+// iterators after where they happen, or all of them if storage grows.
+template <class Key, class Compare = std::less<Key>>
+class flat_set : public detail::flat_tree<Key, Key, detail::identity, Compare,
+                                          const Key *>
+{
+  using base =
+    detail::flat_tree<Key, Key, detail::identity, Compare, const Key *>;
+
+public:
+  using typename base::allocator_type;
+  using typename base::iterator;
+  using typename base::value_type;
+
+  flat_set() : flat_set(Compare()) {}
+
+  explicit flat_set(const Compare &comp,
+                    const allocator_type &alloc = allocator_type())
+    : base(comp, alloc)
+  {}
+
+  explicit flat_set(const allocator_type &alloc) : flat_set(Compare(), alloc)
+  {}
+
+  template <class InputIt,
+            class = typename std::iterator_traits<InputIt>::iterator_category>
+  flat_set(InputIt first, InputIt last, const Compare &comp = Compare(),
+           const allocator_type &alloc = allocator_type())
+    : base(comp, alloc)
+  {
+    this->insert_range(first, last);
+  }
+
+  template <class InputIt,
+            class = typename std::iterator_traits<InputIt>::iterator_category>
+  flat_set(InputIt first, InputIt last, const allocator_type &alloc)
+    : flat_set(first, last, Compare(), alloc)
+  {}
+
+  flat_set(std::initializer_list<Key> init, const Compare &comp = Compare(),
+           const allocator_type &alloc = allocator_type())
+    : flat_set(init.begin(), init.end(), comp, alloc)
+  {}
+
+  flat_set(std::initializer_list<Key> init, const allocator_type &alloc)
+    : flat_set(init.begin(), init.end(), Compare(), alloc)
+  {}
+
+  flat_set(const flat_set &) = default;
+  flat_set(flat_set &&) = default;
+  flat_set(const flat_set &other, const allocator_type &alloc)
+    : base(other, alloc)
+  {}
+  flat_set(flat_set &&other, const allocator_type &alloc)
+    : base(std::move(other), alloc)
+  {}
+
+  flat_set &operator=(const flat_set &) = default;
+  flat_set &operator=(flat_set &&) = default;
+
+  std::pair<iterator, bool> insert(const Key &key)
+  {
+    return this->emplace_key(key, key);
+  }
+
+  std::pair<iterator, bool> insert(Key &&key)
+  {
+    return this->emplace_key(key, std::move(key));
+  }
+
+  template <class InputIt>
+  void insert(InputIt first, InputIt last)
+  {
+    this->insert_range(first, last);
+  }
+
+  void insert(std::initializer_list<Key> init)
+  {
+    this->insert_range(init.begin(), init.end());
+  }
+
+  template <class... Args>
+  std::pair<iterator, bool> emplace(Args &&... args)
+  {
+    return this->emplace_value(std::forward<Args>(args)...);
+  }
+};
+
+} // namespace feroldi::pmr
+#endif
@@ -7,16 +7,47 @@
 #ifndef FEROLDI_CXX17_MEMORY_RESOURCE
 #define FEROLDI_CXX17_MEMORY_RESOURCE
 
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <cassert>
 #include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <functional>
+#include <iterator>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <stdexcept>
 #include <tuple>
 #include <type_traits>
 #include <utility>
 
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
+
+// Whether the resources mark the memory they hold but haven't handed out as
+// poisoned to AddressSanitizer, so that touching it is reported. It's on
+// whenever ASan is, unless FEROLDI_PMR_NO_ASAN_POISONING is defined.
+#if !defined(FEROLDI_PMR_NO_ASAN_POISONING)
+#if defined(__SANITIZE_ADDRESS__)
+#define FEROLDI_PMR_ASAN_POISONING 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define FEROLDI_PMR_ASAN_POISONING 1
+#endif
+#endif
+#endif
+
+#if defined(FEROLDI_PMR_ASAN_POISONING)
+#include <sanitizer/asan_interface.h>
+#endif
+
 /*
 memory_resource synopsis
 namespace std::pmr {
@@ -82,12 +113,72 @@ public:
     return do_is_equal(other);
   }
 
+  // Extension: allocates `count` blocks of `bytes` at `alignment` with a
+  // single virtual call, and stores them in `out`. Either all of them are
+  // allocated, or none is and an exception is thrown.
+  void allocate_bulk(void **out, std::size_t count, std::size_t bytes,
+                     std::size_t alignment = _max_align)
+  {
+    return do_allocate_bulk(out, count, bytes, alignment);
+  }
+
+  // Extension: deallocates `count` blocks, as if by calling `deallocate` with
+  // each of them.
+  void deallocate_bulk(void *const *ptrs, std::size_t count, std::size_t bytes,
+                       std::size_t alignment = _max_align)
+  {
+    return do_deallocate_bulk(ptrs, count, bytes, alignment);
+  }
+
+  // Extension: grows `p`, an allocation of `old_bytes`, to `new_bytes`
+  // without moving it, if the resource can. Returns whether it did;
+  // otherwise, `p` keeps its size. monotonic_buffer_resource can for its
+  // most recent allocation; other resources can't, unless they override it.
+  bool try_expand(void *p, std::size_t old_bytes,
+                  std::size_t new_bytes) noexcept
+  {
+    return do_try_expand(p, old_bytes, new_bytes);
+  }
+
 private:
   // [mem.res.private], private member functions
   virtual void *do_allocate(std::size_t bytes, std::size_t alignment) = 0;
   virtual void do_deallocate(void *p, std::size_t bytes,
                              std::size_t alignment) = 0;
   virtual bool do_is_equal(const memory_resource &other) const noexcept = 0;
+
+protected:
+  // Resources that can allocate many blocks at once for less than the cost of
+  // allocating them one by one override these. By default, they loop, which
+  // overrides may fall back to.
+  virtual void do_allocate_bulk(void **out, std::size_t count,
+                                std::size_t bytes, std::size_t alignment)
+  {
+    std::size_t i = 0;
+    try
+    {
+      for (; i < count; ++i)
+        out[i] = do_allocate(bytes, alignment);
+    }
+    catch (...)
+    {
+      while (i > 0)
+        do_deallocate(out[--i], bytes, alignment);
+      throw;
+    }
+  }
+
+  virtual void do_deallocate_bulk(void *const *ptrs, std::size_t count,
+                                  std::size_t bytes, std::size_t alignment)
+  {
+    for (std::size_t i = 0; i < count; ++i)
+      do_deallocate(ptrs[i], bytes, alignment);
+  }
+
+  virtual bool do_try_expand(void *, std::size_t, std::size_t) noexcept
+  {
+    return false;
+  }
 };
 
 inline bool operator==(const memory_resource &a,
@@ -106,45 +197,21 @@ memory_resource *new_delete_resource() noexcept;
 memory_resource *null_memory_resource() noexcept;
 memory_resource *set_default_resource(memory_resource *r) noexcept;
 memory_resource *get_default_resource() noexcept;
+memory_resource *set_thread_default_resource(memory_resource *r) noexcept;
 
-template <class Tp>
-class polymorphic_allocator
-{
-private:
-  memory_resource *res;
+namespace detail {
 
+// Uses-allocator construction ([allocator.uses.construction]), shared by the
+// allocators in this header. `Alloc` is the allocator deriving from this,
+// which is what gets passed along to the objects being constructed.
+template <class Alloc>
+class uses_allocator_construction
+{
 public:
-  using value_type = Tp;
-
-  // [mem.poly.allocator.ctor], constructors
-  polymorphic_allocator() noexcept : res(get_default_resource()) {}
-  polymorphic_allocator(memory_resource *r) : res(r) { assert(r); }
-
-  polymorphic_allocator(const polymorphic_allocator &) = default;
-
-  template <class U>
-  polymorphic_allocator(const polymorphic_allocator<U> &other) noexcept
-    : res(other.resource())
-  {}
-
-  polymorphic_allocator &operator=(const polymorphic_allocator &) = delete;
-
-  // [mem.poly.allocator.mem], member functions
-  [[nodiscard]] Tp *allocate(std::size_t n)
-  {
-    return static_cast<Tp *>(res->allocate(n * sizeof(Tp), alignof(Tp)));
-  }
-
-  void deallocate(Tp *p, std::size_t n)
-  {
-    return res->deallocate(p, n * sizeof(Tp), alignof(Tp));
-  }
-
   template <class T, class... Args>
   void construct(T *p, Args &&...args)
   {
-    using uses_alloc_tag =
-      uses_alloc_ctor_t<T, polymorphic_allocator &, Args...>;
+    using uses_alloc_tag = uses_alloc_ctor_t<T, Alloc &, Args...>;
     return _construct(uses_alloc_tag(), p, std::forward<Args>(args)...);
   }
 
@@ -152,14 +219,12 @@ public:
   void construct(std::pair<T1, T2> *p, std::piecewise_construct_t,
                  std::tuple<Args1...> x, std::tuple<Args2...> y)
   {
-    using x_uses_alloc_tag =
-      uses_alloc_ctor_t<T1, polymorphic_allocator &, Args1...>;
-    using y_uses_alloc_tag =
-      uses_alloc_ctor_t<T2, polymorphic_allocator &, Args2...>;
+    using x_uses_alloc_tag = uses_alloc_ctor_t<T1, Alloc &, Args1...>;
+    using y_uses_alloc_tag = uses_alloc_ctor_t<T2, Alloc &, Args2...>;
 
     ::new (p) std::pair<T1, T2>(std::piecewise_construct,
-                                _construct_p(x_uses_alloc_tag(), std::move(x)),
-                                _construct_p(y_uses_alloc_tag(), std::move(y)));
+                                _construct_p(x_uses_alloc_tag(), x),
+                                _construct_p(y_uses_alloc_tag(), y));
   }
 
   template <class T1, class T2>
@@ -172,14 +237,16 @@ public:
   template <class T1, class T2, class U, class V>
   void construct(std::pair<T1, T2> *p, U &&x, V &&y)
   {
-    return construct(p, std::forward_as_tuple(std::forward<U>(x)),
+    return construct(p, std::piecewise_construct,
+                     std::forward_as_tuple(std::forward<U>(x)),
                      std::forward_as_tuple(std::forward<V>(y)));
   }
 
   template <class T1, class T2, class U, class V>
   void construct(std::pair<T1, T2> *p, const std::pair<U, V> &pr)
   {
-    return construct(p, std::forward_as_tuple(pr.first),
+    return construct(p, std::piecewise_construct,
+                     std::forward_as_tuple(pr.first),
                      std::forward_as_tuple(pr.second));
   }
 
@@ -197,28 +264,23 @@ public:
     p->~T();
   }
 
-  polymorphic_allocator select_on_container_copy_construction() const
-  {
-    return polymorphic_allocator();
-  }
-
-  memory_resource *resource() const { return res; }
-
 private:
-  template <bool UsesAlloc, typename T, typename Alloc, typename... Args>
+  Alloc &self() { return static_cast<Alloc &>(*this); }
+
+  template <bool UsesAlloc, typename T, typename A, typename... Args>
   struct uses_alloc_ctor_impl
   {
     static const int value = 0;
   };
 
-  template <typename T, typename Alloc, typename... Args>
-  struct uses_alloc_ctor_impl<true, T, Alloc, Args...>
+  template <typename T, typename A, typename... Args>
+  struct uses_alloc_ctor_impl<true, T, A, Args...>
   {
     static const bool first_ctor =
-      std::is_constructible_v<T, std::allocator_arg_t, Alloc, Args...>;
+      std::is_constructible_v<T, std::allocator_arg_t, A, Args...>;
     static const bool second_ctor =
       std::conditional_t<first_ctor, std::false_type,
-                         std::is_constructible<T, Args..., Alloc>>::value;
+                         std::is_constructible<T, Args..., A>>::value;
 
     static_assert(first_ctor || second_ctor,
                   " request for uses-allocator construction is ill-formed");
@@ -228,16 +290,16 @@ private:
 
   // FIXME: std::uses_allocator might not consider std::erased_type for
   // libraries that don't implement it.
-  template <typename T, typename Alloc, typename... Args>
+  template <typename T, typename A, typename... Args>
   struct uses_alloc_ctor
   {
     using type = std::integral_constant<
-      int, uses_alloc_ctor_impl<std::uses_allocator_v<T, Alloc>, T, Alloc,
-                                Args...>::value>;
+      int,
+      uses_alloc_ctor_impl<std::uses_allocator_v<T, A>, T, A, Args...>::value>;
   };
 
-  template <typename T, typename Alloc, typename... Args>
-  using uses_alloc_ctor_t = typename uses_alloc_ctor<T, Alloc, Args...>::type;
+  template <typename T, typename A, typename... Args>
+  using uses_alloc_ctor_t = typename uses_alloc_ctor<T, A, Args...>::type;
 
   using uses_alloc0 = std::integral_constant<int, 0>;
   using uses_alloc1 = std::integral_constant<int, 1>;
@@ -252,13 +314,13 @@ private:
   template <typename T, typename... Args>
   void _construct(uses_alloc1, T *storage, Args &&...args)
   {
-    ::new (storage) T(std::allocator_arg, *this, std::forward<Args>(args)...);
+    ::new (storage) T(std::allocator_arg, self(), std::forward<Args>(args)...);
   }
 
   template <typename T, typename... Args>
   void _construct(uses_alloc2, T *storage, Args &&...args)
   {
-    ::new (storage) T(std::forward<Args>(args)..., *this);
+    ::new (storage) T(std::forward<Args>(args)..., self());
   }
 
   // Piecewise construction.
@@ -272,15 +334,118 @@ private:
   template <typename... Args>
   decltype(auto) _construct_p(uses_alloc1, std::tuple<Args...> &t)
   {
-    return std::tuple_cat(std::make_tuple(std::allocator_arg, *this),
+    return std::tuple_cat(std::make_tuple(std::allocator_arg, self()),
                           std::move(t));
   }
 
   template <typename... Args>
   decltype(auto) _construct_p(uses_alloc2, std::tuple<Args...> &t)
   {
-    return std::tuple_cat(std::move(t), std::make_tuple(*this));
+    return std::tuple_cat(std::move(t), std::make_tuple(self()));
+  }
+};
+
+// Whether a resource has non-virtual `allocate_fast` and `deallocate_fast`
+// member functions.
+template <class Resource, class = void>
+struct has_fast_path : std::false_type
+{};
+
+template <class Resource>
+struct has_fast_path<
+  Resource,
+  std::void_t<decltype(std::declval<Resource &>().allocate_fast(
+                std::size_t(), std::size_t())),
+              decltype(std::declval<Resource &>().deallocate_fast(
+                nullptr, std::size_t(), std::size_t()))>> : std::true_type
+{};
+
+template <class Resource>
+inline constexpr bool has_fast_path_v = has_fast_path<Resource>::value;
+
+} // namespace detail
+
+template <class Tp>
+class polymorphic_allocator
+  : public detail::uses_allocator_construction<polymorphic_allocator<Tp>>
+{
+private:
+  memory_resource *res;
+
+public:
+  using value_type = Tp;
+
+  // [mem.poly.allocator.ctor], constructors
+  polymorphic_allocator() noexcept : res(get_default_resource()) {}
+  polymorphic_allocator(memory_resource *r) : res(r) { assert(r); }
+
+  polymorphic_allocator(const polymorphic_allocator &) = default;
+
+  template <class U>
+  polymorphic_allocator(const polymorphic_allocator<U> &other) noexcept
+    : res(other.resource())
+  {}
+
+  polymorphic_allocator &operator=(const polymorphic_allocator &) = delete;
+
+  // [mem.poly.allocator.mem], member functions
+  [[nodiscard]] Tp *allocate(std::size_t n)
+  {
+    return static_cast<Tp *>(res->allocate(n * sizeof(Tp), alignof(Tp)));
+  }
+
+  void deallocate(Tp *p, std::size_t n)
+  {
+    return res->deallocate(p, n * sizeof(Tp), alignof(Tp));
+  }
+
+  // Extension: allocates storage for `count` objects, each on its own, and
+  // stores it in `out`. Either all of it is allocated, or none is.
+  void allocate_bulk(Tp **out, std::size_t count)
+  {
+    // The resource deals in pointers to void, so they're converted in
+    // batches.
+    void *batch[64];
+    std::size_t done = 0;
+    try
+    {
+      while (done < count)
+      {
+        const auto n = std::min(count - done, std::size(batch));
+        res->allocate_bulk(batch, n, sizeof(Tp), alignof(Tp));
+        for (std::size_t i = 0; i < n; ++i)
+          out[done + i] = static_cast<Tp *>(batch[i]);
+        done += n;
+      }
+    }
+    catch (...)
+    {
+      deallocate_bulk(out, done);
+      throw;
+    }
+  }
+
+  // Extension: deallocates storage for `count` objects, each obtained on its
+  // own from allocate() or allocate_bulk().
+  void deallocate_bulk(Tp *const *ptrs, std::size_t count)
+  {
+    void *batch[64];
+    for (std::size_t done = 0; done < count;)
+    {
+      const auto n = std::min(count - done, std::size(batch));
+      for (std::size_t i = 0; i < n; ++i)
+        batch[i] = ptrs[done + i];
+      res->deallocate_bulk(batch, n, sizeof(Tp), alignof(Tp));
+      done += n;
+    }
+  }
+
+  polymorphic_allocator select_on_container_copy_construction() const
+  {
+    return polymorphic_allocator();
   }
+
+  memory_resource *resource() const { return res; }
 };
 
 template <class T1, class T2>
@@ -297,210 +462,3700 @@ inline bool operator!=(const polymorphic_allocator<T1> &a,
   return !(a == b);
 }
 
-// TODO: synchronized_pool_resource
-// TODO: unsynchronized_pool_resource
-#if 0
-struct pool_options
+// An allocator like polymorphic_allocator, but which knows the concrete type
+// of its memory resource. Resources with a non-virtual fast path (such as
+// monotonic_buffer_resource's `allocate_fast`) are called through it, so
+// allocations can be inlined into containers. For other resources, calls are
+// devirtualized when `Resource` is a final class.
+//
+// It converts to a polymorphic_allocator using the same resource.
+template <class Tp, class Resource>
+class resource_allocator
+  : public detail::uses_allocator_construction<resource_allocator<Tp, Resource>>
 {
-  size_t max_blocks_per_chunk = 0;
-  size_t largest_required_pool_block = 0;
-};
+  static_assert(std::is_base_of_v<memory_resource, Resource>,
+                "Resource must derive from memory_resource");
+
+private:
+  Resource *res;
 
-class synchronized_pool_resource : public memory_resource
-{
 public:
-  synchronized_pool_resource(const pool_options &opts,
-                             memory_resource *upstream);
+  using value_type = Tp;
+  using resource_type = Resource;
 
-  synchronized_pool_resource()
-    : synchronized_pool_resource(pool_options(), get_default_resource())
-  {}
-  explicit synchronized_pool_resource(memory_resource *upstream)
-    : synchronized_pool_resource(pool_options(), upstream)
-  {}
-  explicit synchronized_pool_resource(const pool_options &opts)
-    : synchronized_pool_resource(opts, get_default_resource())
+  resource_allocator(Resource *r) noexcept : res(r) { assert(r); }
+
+  resource_allocator(const resource_allocator &) = default;
+
+  template <class U>
+  resource_allocator(const resource_allocator<U, Resource> &other) noexcept
+    : res(other.resource())
   {}
 
-  synchronized_pool_resource(const synchronized_pool_resource &) = delete;
-  virtual ~synchronized_pool_resource();
+  resource_allocator &operator=(const resource_allocator &) = delete;
 
-  synchronized_pool_resource &
-  operator=(const synchronized_pool_resource &) = delete;
+  [[nodiscard]] Tp *allocate(std::size_t n)
+  {
+    if constexpr (detail::has_fast_path_v<Resource>)
+      return static_cast<Tp *>(
+        res->allocate_fast(n * sizeof(Tp), alignof(Tp)));
+    else
+      return static_cast<Tp *>(res->allocate(n * sizeof(Tp), alignof(Tp)));
+  }
 
-  void release();
-  memory_resource *upstream_resource() const;
-  pool_options options() const;
+  void deallocate(Tp *p, std::size_t n)
+  {
+    if constexpr (detail::has_fast_path_v<Resource>)
+      return res->deallocate_fast(p, n * sizeof(Tp), alignof(Tp));
+    else
+      return res->deallocate(p, n * sizeof(Tp), alignof(Tp));
+  }
 
-protected:
-  void *do_allocate(std::size_t bytes, std::size_t alignment) override;
-  void do_deallocate(void *p, std::size_t bytes,
-                     std::size_t alignment) override;
-  bool do_is_equal(const memory_resource &other) const noexcept override;
+  // There's no default resource of an arbitrary type, so copies of a
+  // container keep using the same resource.
+  resource_allocator select_on_container_copy_construction() const
+  {
+    return *this;
+  }
+
+  Resource *resource() const { return res; }
+
+  template <class U>
+  operator polymorphic_allocator<U>() const noexcept
+  {
+    return polymorphic_allocator<U>(res);
+  }
 };
 
-class unsynchronized_pool_resource : public memory_resource
+template <class T1, class T2, class Resource>
+inline bool operator==(const resource_allocator<T1, Resource> &a,
+                       const resource_allocator<T2, Resource> &b) noexcept
 {
-public:
-  unsynchronized_pool_resource(const pool_options &opts,
-                               memory_resource *upstream);
+  return *a.resource() == *b.resource();
+}
 
-  unsynchronized_pool_resource()
-    : unsynchronized_pool_resource(pool_options(), get_default_resource())
-  {}
-  explicit unsynchronized_pool_resource(memory_resource *upstream)
-    : unsynchronized_pool_resource(pool_options(), upstream)
-  {}
-  explicit unsynchronized_pool_resource(const pool_options &opts)
-    : unsynchronized_pool_resource(opts, get_default_resource())
-  {}
+template <class T1, class T2, class Resource>
+inline bool operator!=(const resource_allocator<T1, Resource> &a,
+                       const resource_allocator<T2, Resource> &b) noexcept
+{
+  return !(a == b);
+}
 
-  unsynchronized_pool_resource(const unsynchronized_pool_resource &) = delete;
-  virtual ~unsynchronized_pool_resource();
+// [mem.res.pool.options], pool_options
+struct pool_options
+{
+  std::size_t max_blocks_per_chunk = 0;
+  std::size_t largest_required_pool_block = 0;
 
-  unsynchronized_pool_resource &
-  operator=(const unsynchronized_pool_resource &) = delete;
+  // Extension: block sizes of the pools, in increasing order, which replace
+  // the default power-of-two sizes, and `largest_required_pool_block`. Sizes
+  // are rounded up to a multiple of `alignof(void *)`, and blocks are aligned
+  // to the largest power of two that divides their size. The table is copied.
+  const std::size_t *size_classes = nullptr;
+  std::size_t size_class_count = 0;
 
-  void release();
-  memory_resource *upstream_resource() const;
-  pool_options options() const;
+  // Extension: number of allocations whose sizes are recorded, from the
+  // first one on, so that the resource can recommend size classes for them.
+  // Zero disables recording.
+  std::size_t histogram_samples = 0;
 
-protected:
-  void *do_allocate(std::size_t bytes, std::size_t alignment) override;
-  void do_deallocate(void *p, std::size_t bytes,
-                     std::size_t alignment) override;
-  bool do_is_equal(const memory_resource &other) const noexcept override;
+  // Extension: every this many deallocations, the resource calls
+  // `trim(decay_retained_bytes)` on itself, so that memory freed after a
+  // peak goes back to upstream. For synchronized_pool_resource, only blocks
+  // that threads' caches give back to the shared pools count. Zero disables
+  // it.
+  std::size_t decay_interval = 0;
+  std::size_t decay_retained_bytes = 0;
 };
-#endif
 
-class monotonic_buffer_resource : public memory_resource
+// Extension: writes to `out` up to `max_count` size classes in the style of
+// jemalloc's, from 8 up to `largest`, with `per_doubling` classes between
+// consecutive powers of two, and returns how many were written. Padding is
+// then at most `1 / per_doubling` of a request's size, with far fewer classes
+// than a linear table. They're meant as a pool resource's `size_classes`.
+inline std::size_t geometric_size_classes(std::size_t *out,
+                                          std::size_t max_count,
+                                          std::size_t largest,
+                                          std::size_t per_doubling = 4) noexcept
 {
-public:
-  explicit monotonic_buffer_resource(memory_resource *mr) : upstream(mr) {}
+  constexpr std::size_t quantum = 8;
+  per_doubling = std::max<std::size_t>(per_doubling, 1);
 
-  monotonic_buffer_resource(std::size_t initial_size, memory_resource *mr)
-    : upstream(mr), next_region_size(initial_size)
+  std::size_t count = 0;
+  std::size_t size = quantum;
+  while (size <= largest && count < max_count)
   {
-    assert(initial_size > 0);
-  }
+    out[count++] = size;
 
-  monotonic_buffer_resource(void *buffer, std::size_t buffer_size,
-                            memory_resource *mr)
-    : upstream(mr)
-    , region_base_ptr(reinterpret_cast<std::byte *>(buffer))
-    , region_cur_ptr(reinterpret_cast<std::byte *>(buffer))
-    , region_end_ptr(reinterpret_cast<std::byte *>(buffer) + buffer_size)
-    , next_region_size(compute_next_grow(buffer_size))
-  {
-    assert(buffer_size > 0);
+    // The step is a fraction of the largest power of two not above `size`.
+    std::size_t power = quantum;
+    while (power <= size / 2)
+      power *= 2;
+    size += std::max(power / per_doubling, quantum);
   }
 
-  monotonic_buffer_resource()
-    : monotonic_buffer_resource(get_default_resource())
-  {}
+  if (count < max_count && (count == 0 || out[count - 1] < largest))
+    out[count++] = largest;
+  return count;
+}
 
-  explicit monotonic_buffer_resource(std::size_t initial_size)
-    : monotonic_buffer_resource(initial_size, get_default_resource())
-  {}
+namespace detail {
 
-  monotonic_buffer_resource(void *buffer, std::size_t buffer_size)
-    : monotonic_buffer_resource(buffer, buffer_size, get_default_resource())
-  {}
+// Returns the smallest `r` such that `2^r >= n`.
+inline std::size_t ceil_log2(std::size_t n) noexcept
+{
+  if (n <= 1)
+    return 0;
+#if defined(__GNUC__)
+  return static_cast<std::size_t>(
+    std::numeric_limits<unsigned long long>::digits -
+    __builtin_clzll(static_cast<unsigned long long>(n - 1)));
+#else
+  std::size_t r = 0;
+  while ((std::size_t(1) << r) < n)
+    ++r;
+  return r;
+#endif
+}
 
-  monotonic_buffer_resource(const monotonic_buffer_resource &) = delete;
+constexpr std::size_t round_up(std::size_t n, std::size_t alignment) noexcept
+{
+  return (n + alignment - 1) & ~(alignment - 1);
+}
 
-  virtual ~monotonic_buffer_resource() override { release(); }
+#if defined(FEROLDI_PMR_ASAN_POISONING)
+inline constexpr bool asan_poisoning = true;
+#else
+inline constexpr bool asan_poisoning = false;
+#endif
 
-  monotonic_buffer_resource &
-  operator=(const monotonic_buffer_resource &) = delete;
+// Marks `bytes` at `p` as off limits to AddressSanitizer, which reports any
+// access to them until they're unpoisoned. ASan tracks memory in granules of
+// 8 bytes, so a granule shared with memory in use is left accessible. Both
+// do nothing without ASan.
+inline void asan_poison(const void *p, std::size_t bytes) noexcept
+{
+#if defined(FEROLDI_PMR_ASAN_POISONING)
+  if (bytes != 0)
+    ASAN_POISON_MEMORY_REGION(p, bytes);
+#else
+  (void)p;
+  (void)bytes;
+#endif
+}
 
-  void release()
-  {
-    // Deallocates all regions by walking backwards in the list. Stops walking
-    // if we hit a buffer we don't own, or when there aren't any more regions.
-    while (owns_region && region_base_ptr)
-    {
-      owned_region_header header;
-      std::memcpy(&header, region_base_ptr, sizeof(header));
-      upstream->deallocate(region_base_ptr, region_size());
-      region_base_ptr = header.prev_region_base_ptr;
-      region_end_ptr = header.prev_region_end_ptr;
-      owns_region = header.owns_prev_region;
-    }
+inline void asan_unpoison(const void *p, std::size_t bytes) noexcept
+{
+#if defined(FEROLDI_PMR_ASAN_POISONING)
+  if (bytes != 0)
+    ASAN_UNPOISON_MEMORY_REGION(p, bytes);
+#else
+  (void)p;
+  (void)bytes;
+#endif
+}
 
-    assert(!owns_region);
-    region_cur_ptr = region_base_ptr;
-  }
+// Implementation-defined limits for pool_options. Values of zero in a
+// pool_options are replaced by the defaults, and values above the maximums
+// are clamped to them.
+constexpr std::size_t default_max_blocks_per_chunk = 1024;
+constexpr std::size_t max_max_blocks_per_chunk = std::size_t(1) << 20;
+constexpr std::size_t default_largest_required_pool_block = 4096;
+constexpr std::size_t max_largest_required_pool_block = std::size_t(1) << 20;
+constexpr std::size_t initial_blocks_per_chunk = 16;
 
-  memory_resource *upstream_resource() const { return upstream; }
+// Chunks of a pool are at most this large, unless a single block needs more.
+constexpr std::size_t max_pool_chunk_size = std::size_t(1) << 20;
 
-protected:
-  void *do_allocate(std::size_t bytes, std::size_t alignment) override
-  {
-    if (region_base_ptr)
+// Intrusive link stored in the first bytes of a free block.
+struct pool_free_block
+{
+  pool_free_block *next;
+};
+
+// Smallest block a pool hands out, which must be able to hold a free list
+// link.
+constexpr std::size_t min_pool_block_size = sizeof(pool_free_block);
+
+// Poisons a free block of `size` bytes, except for its link, which is read
+// and written while the block is in a free list. It's unpoisoned as a whole
+// when it's handed out again.
+inline void asan_poison_free_block(void *block, std::size_t size) noexcept
+{
+  asan_poison(static_cast<std::byte *>(block) + sizeof(pool_free_block),
+              size - sizeof(pool_free_block));
+}
+
+// Links `n` free blocks together, in order, and returns the first one. At
+// least one block must be given, and `last` gets the last one.
+inline pool_free_block *link_blocks(void *const *ptrs, std::size_t n,
+                                    pool_free_block *&last) noexcept
+{
+  assert(n > 0);
+  const auto first = static_cast<pool_free_block *>(ptrs[0]);
+  last = first;
+  for (std::size_t i = 1; i < n; ++i)
+  {
+    const auto block = static_cast<pool_free_block *>(ptrs[i]);
+    last->next = block;
+    last = block;
+  }
+  return first;
+}
+
+inline pool_options normalize_pool_options(pool_options opts) noexcept
+{
+  if (opts.max_blocks_per_chunk == 0)
+    opts.max_blocks_per_chunk = default_max_blocks_per_chunk;
+  else if (opts.max_blocks_per_chunk > max_max_blocks_per_chunk)
+    opts.max_blocks_per_chunk = max_max_blocks_per_chunk;
+
+  if (opts.largest_required_pool_block == 0)
+    opts.largest_required_pool_block = default_largest_required_pool_block;
+  else if (opts.largest_required_pool_block > max_largest_required_pool_block)
+    opts.largest_required_pool_block = max_largest_required_pool_block;
+  else if (opts.largest_required_pool_block < min_pool_block_size)
+    opts.largest_required_pool_block = min_pool_block_size;
+
+  if (opts.size_classes && opts.size_class_count != 0)
+  {
+    // The largest block is the largest size class which isn't clamped.
+    std::size_t largest = 0;
+    for (std::size_t i = 0; i < opts.size_class_count; ++i)
+    {
+      const auto size = round_up(
+        std::max(opts.size_classes[i], min_pool_block_size),
+        min_pool_block_size);
+      if (size <= max_largest_required_pool_block)
+        largest = std::max(largest, size);
+    }
+    opts.largest_required_pool_block =
+      largest != 0 ? largest : min_pool_block_size;
+    return opts;
+  }
+
+  // Pools have power-of-two block sizes, so the largest block is rounded up.
+  opts.size_classes = nullptr;
+  opts.size_class_count = 0;
+  opts.largest_required_pool_block =
+    std::size_t(1) << ceil_log2(opts.largest_required_pool_block);
+  return opts;
+}
+
+// Number of pools needed for normalized options, one per block size.
+inline std::size_t pool_count(const pool_options &opts) noexcept
+{
+  return ceil_log2(opts.largest_required_pool_block) -
+         ceil_log2(min_pool_block_size) + 1;
+}
+
+// Index of the pool whose blocks fit `bytes` at `alignment`. Blocks are
+// aligned to their own size, so the alignment is just a lower bound on it.
+inline std::size_t pool_index(std::size_t bytes, std::size_t alignment) noexcept
+{
+  const auto size = std::max({bytes, alignment, min_pool_block_size});
+  return ceil_log2(size) - ceil_log2(min_pool_block_size);
+}
+
+// Alignment of the blocks of a pool, which is the largest power of two that
+// divides their size.
+constexpr std::size_t block_alignment(std::size_t block_size) noexcept
+{
+  return block_size & (~block_size + 1);
+}
+
+// Block sizes of a pool resource's pools, from normalized options. By
+// default, they're powers of two, whose index is computed directly. Explicit
+// tables are binary searched instead.
+class size_class_table
+{
+public:
+  explicit size_class_table(const pool_options &opts)
+  {
+    if (!opts.size_classes || opts.size_class_count == 0)
+    {
+      n = pool_count(opts);
+      return;
+    }
+
+    // Sizes which don't increase after rounding are dropped.
+    sizes = std::make_unique<std::size_t[]>(opts.size_class_count);
+    for (std::size_t i = 0; i < opts.size_class_count; ++i)
+    {
+      const auto size = round_up(
+        std::max(opts.size_classes[i], min_pool_block_size),
+        min_pool_block_size);
+      if (size > opts.largest_required_pool_block)
+        break;
+      if (n == 0 || size > sizes[n - 1])
+        sizes[n++] = size;
+    }
+
+    if (n == 0)
+      sizes[n++] = min_pool_block_size;
+  }
+
+  size_class_table(const size_class_table &) = delete;
+  size_class_table &operator=(const size_class_table &) = delete;
+
+  // The explicit table, or null for power-of-two sizes.
+  const std::size_t *data() const noexcept { return sizes.get(); }
+
+  std::size_t count() const noexcept { return n; }
+
+  std::size_t block_size(std::size_t index) const noexcept
+  {
+    assert(index < n);
+    return sizes ? sizes[index] : min_pool_block_size << index;
+  }
+
+  // Index of the smallest class that fits `bytes` at `alignment`, or
+  // `count()` if there's none.
+  std::size_t index(std::size_t bytes, std::size_t alignment) const noexcept
+  {
+    if (!sizes)
+      return pool_index(bytes, alignment);
+
+    auto i = static_cast<std::size_t>(
+      std::lower_bound(sizes.get(), sizes.get() + n, bytes) - sizes.get());
+    while (i < n && block_alignment(sizes[i]) < alignment)
+      ++i;
+    return i;
+  }
+
+private:
+  std::unique_ptr<std::size_t[]> sizes;
+  std::size_t n = 0;
+};
+
+// Counts the sizes of the first allocations a pool resource serves, so that
+// size classes can be recommended for them. Sizes are counted in buckets of
+// at least `min_pool_block_size` bytes, up to the largest pool block. It's
+// thread-safe.
+class size_histogram
+{
+public:
+  size_histogram(std::size_t largest_block, std::size_t samples)
+    : largest(largest_block), samples(samples)
+  {
+    // Buckets are kept to a thousand or so, however large blocks get.
+    granularity = min_pool_block_size;
+    while (largest / granularity > 1024)
+      granularity *= 2;
+    bucket_count = (largest + granularity - 1) / granularity;
+    counts = std::make_unique<std::atomic<std::uint64_t>[]>(bucket_count);
+    for (std::size_t i = 0; i < bucket_count; ++i)
+      counts[i].store(0, std::memory_order_relaxed);
+  }
+
+  void record(std::size_t bytes) noexcept
+  {
+    if (recorded.load(std::memory_order_relaxed) >= samples)
+      return;
+    if (recorded.fetch_add(1, std::memory_order_relaxed) >= samples)
+      return;
+    if (bytes <= largest)
+    {
+      const auto bucket = (std::max<std::size_t>(bytes, 1) - 1) / granularity;
+      counts[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  // Chooses up to `max_classes` block sizes for the recorded allocations,
+  // the last of which is the largest block, such that the bytes they waste
+  // in padding are minimal. Writes them to `out`, and returns how many
+  // there are.
+  std::size_t recommend(std::size_t *out, std::size_t max_classes) const
+  {
+    if (max_classes == 0)
+      return 0;
+
+    // Candidate sizes are the upper bounds of the buckets that were hit, plus
+    // the largest block, so that every size stays covered.
+    const auto sizes = std::make_unique<std::size_t[]>(bucket_count + 1);
+    const auto weights = std::make_unique<std::uint64_t[]>(bucket_count + 1);
+    std::size_t m = 0;
+    for (std::size_t i = 0; i < bucket_count; ++i)
+    {
+      const auto count = counts[i].load(std::memory_order_relaxed);
+      if (count == 0)
+        continue;
+      sizes[m] = std::min((i + 1) * granularity, largest);
+      weights[m++] = count;
+    }
+    if (m == 0 || sizes[m - 1] != largest)
+    {
+      sizes[m] = largest;
+      weights[m++] = 0;
+    }
+
+    const auto k_max = std::min(max_classes, m);
+    if (k_max == m)
+    {
+      std::copy(sizes.get(), sizes.get() + m, out);
+      return m;
+    }
+
+    // Prefix sums of counts and of bytes, so that the padding of assigning
+    // candidates `a` to `i` to class `sizes[i]` takes constant time.
+    const auto counts_sum = std::make_unique<std::uint64_t[]>(m + 1);
+    const auto bytes_sum = std::make_unique<std::uint64_t[]>(m + 1);
+    counts_sum[0] = bytes_sum[0] = 0;
+    for (std::size_t i = 0; i < m; ++i)
+    {
+      counts_sum[i + 1] = counts_sum[i] + weights[i];
+      bytes_sum[i + 1] = bytes_sum[i] + weights[i] * sizes[i];
+    }
+    const auto padding = [&](std::size_t a, std::size_t i) {
+      return sizes[i] * (counts_sum[i + 1] - counts_sum[a]) -
+             (bytes_sum[i + 1] - bytes_sum[a]);
+    };
+
+    // `cost[i]` is the least padding of candidates up to `i` with `k`
+    // classes, the last of which is `sizes[i]`, and `from[k][i]` is where the
+    // class before it is.
+    constexpr auto infinite = std::numeric_limits<std::uint64_t>::max();
+    auto cost = std::make_unique<std::uint64_t[]>(m);
+    auto next_cost = std::make_unique<std::uint64_t[]>(m);
+    const auto from = std::make_unique<std::size_t[]>(k_max * m);
+    for (std::size_t i = 0; i < m; ++i)
+      cost[i] = padding(0, i);
+
+    for (std::size_t k = 1; k < k_max; ++k)
+    {
+      for (std::size_t i = 0; i < m; ++i)
+      {
+        next_cost[i] = infinite;
+        for (std::size_t a = k - 1; a < i; ++a)
+        {
+          if (cost[a] == infinite)
+            continue;
+          const auto c = cost[a] + padding(a + 1, i);
+          if (c < next_cost[i])
+          {
+            next_cost[i] = c;
+            from[k * m + i] = a;
+          }
+        }
+      }
+      std::swap(cost, next_cost);
+    }
+
+    auto i = m - 1;
+    for (auto k = k_max; k-- > 0;)
+    {
+      out[k] = sizes[i];
+      if (k > 0)
+        i = from[k * m + i];
+    }
+    return k_max;
+  }
+
+  // Number of allocations recorded so far.
+  std::size_t recorded_count() const noexcept
+  {
+    return std::min<std::size_t>(recorded.load(std::memory_order_relaxed),
+                                 samples);
+  }
+
+private:
+  std::size_t largest;
+  std::size_t samples;
+  std::size_t granularity;
+  std::size_t bucket_count;
+  std::unique_ptr<std::atomic<std::uint64_t>[]> counts;
+  std::atomic<std::size_t> recorded{0};
+};
+
+// A pool of equally sized blocks. Blocks are carved out of chunks obtained
+// from an upstream memory resource, and freed blocks are kept in an intrusive
+// singly linked list, so that they are reused in constant time.
+//
+// Blocks have no header. Instead, chunks have a power-of-two size, fixed per
+// pool, and are aligned to it, so the chunk a block belongs to, and the
+// header at the chunk's end, are found by masking the block's address. A
+// chunk holds up to `max_blocks_per_chunk` blocks, or `max_pool_chunk_size`
+// bytes of them, and its blocks are carved lazily, so its memory isn't
+// touched until it's used.
+class block_pool
+{
+public:
+  // Information about a chunk, stored right after its last block. Chunks are
+  // linked together so they can be released.
+  struct chunk_header
+  {
+    chunk_header *prev;
+    block_pool *pool; ///< Pool the chunk belongs to.
+    std::size_t free_blocks; ///< Blocks in the free list, counted by `trim`.
+  };
+
+  static_assert(alignof(chunk_header) <= min_pool_block_size,
+                "chunk headers must be aligned after any block");
+
+  block_pool(std::size_t block_size, std::size_t max_blocks_per_chunk) noexcept
+    : blk_size(block_size)
+    , chunk_sz(chunk_size_for(block_size, max_blocks_per_chunk))
+    , chunk_blocks((chunk_sz - sizeof(chunk_header)) / block_size)
+  {
+    assert(block_size >= min_pool_block_size);
+    assert(block_size % min_pool_block_size == 0);
+    assert(chunk_blocks > 0);
+  }
+
+  block_pool(const block_pool &) = delete;
+  block_pool &operator=(const block_pool &) = delete;
+
+  std::size_t block_size() const noexcept { return blk_size; }
+  std::size_t chunk_size() const noexcept { return chunk_sz; }
+
+  // Header of the chunk that holds block `p`.
+  chunk_header *chunk_of(const void *p) const noexcept
+  {
+    const auto base =
+      reinterpret_cast<std::uintptr_t>(p) & ~(std::uintptr_t(chunk_sz) - 1);
+    return reinterpret_cast<chunk_header *>(base + chunk_sz -
+                                            sizeof(chunk_header));
+  }
+
+  // Whether `p` is a block of this pool. It may only be called with blocks
+  // of pools whose chunks are at least as large as this one's, since the
+  // header of a smaller chunk isn't where masking finds it.
+  bool owns(const void *p) const noexcept { return chunk_of(p)->pool == this; }
+
+  void *allocate(memory_resource *upstream)
+  {
+    if (free_list)
+    {
+      auto block = free_list;
+      free_list = block->next;
+      asan_unpoison(block, blk_size);
+      return block;
+    }
+
+    if (chunk_cur_ptr == chunk_end_ptr)
+      replenish(upstream);
+
+    void *block = chunk_cur_ptr;
+    chunk_cur_ptr += blk_size;
+    asan_unpoison(block, blk_size);
+    return block;
+  }
+
+  void deallocate(void *p) noexcept
+  {
+    auto block = static_cast<pool_free_block *>(p);
+    block->next = free_list;
+    free_list = block;
+    asan_poison_free_block(block, blk_size);
+  }
+
+  // Takes up to `n` blocks out of the pool, linked together, and stores how
+  // many were taken in `count`. At least one block is always returned.
+  pool_free_block *allocate_batch(memory_resource *upstream, std::size_t n,
+                                  std::size_t &count)
+  {
+    assert(n > 0);
+    if (free_list)
+    {
+      auto first = free_list;
+      auto last = first;
+      count = 1;
+      while (count < n && last->next)
+      {
+        last = last->next;
+        ++count;
+      }
+      free_list = last->next;
+      last->next = nullptr;
+      return first;
+    }
+
+    if (chunk_cur_ptr == chunk_end_ptr)
+      replenish(upstream);
+
+    const auto available =
+      static_cast<std::size_t>(chunk_end_ptr - chunk_cur_ptr) / blk_size;
+    count = std::min(n, available);
+
+    // The blocks are left poisoned like free ones, but for their links.
+    auto first = reinterpret_cast<pool_free_block *>(chunk_cur_ptr);
+    for (std::size_t i = 0; i < count; ++i)
+      asan_unpoison(chunk_cur_ptr + i * blk_size, sizeof(pool_free_block));
+    for (std::size_t i = 1; i < count; ++i)
+    {
+      chunk_cur_ptr += blk_size;
+      reinterpret_cast<pool_free_block *>(chunk_cur_ptr - blk_size)->next =
+        reinterpret_cast<pool_free_block *>(chunk_cur_ptr);
+    }
+    reinterpret_cast<pool_free_block *>(chunk_cur_ptr)->next = nullptr;
+    chunk_cur_ptr += blk_size;
+    return first;
+  }
+
+  // Puts back a list of blocks, from `first` to `last`, in constant time.
+  void deallocate_batch(pool_free_block *first, pool_free_block *last) noexcept
+  {
+    last->next = free_list;
+    free_list = first;
+  }
+
+  // Takes `n` blocks out of the pool and stores them in `out`. If obtaining a
+  // chunk throws, the blocks taken so far are put back.
+  void allocate_bulk(memory_resource *upstream, void **out, std::size_t n)
+  {
+    std::size_t i = 0;
+    for (; i < n && free_list; ++i)
+    {
+      out[i] = free_list;
+      free_list = free_list->next;
+      asan_unpoison(out[i], blk_size);
+    }
+
+    try
+    {
+      while (i < n)
+      {
+        if (chunk_cur_ptr == chunk_end_ptr)
+          replenish(upstream);
+        for (; i < n && chunk_cur_ptr != chunk_end_ptr; ++i)
+        {
+          out[i] = chunk_cur_ptr;
+          chunk_cur_ptr += blk_size;
+          asan_unpoison(out[i], blk_size);
+        }
+      }
+    }
+    catch (...)
+    {
+      while (i > 0)
+        deallocate(out[--i]);
+      throw;
+    }
+  }
+
+  // Gives every chunk back to upstream, regardless of whether its blocks were
+  // deallocated.
+  void release(memory_resource *upstream) noexcept
+  {
+    while (chunks)
+    {
+      const auto prev = chunks->prev;
+      asan_unpoison(base_of(chunks), chunk_sz);
+      upstream->deallocate(base_of(chunks), chunk_sz, chunk_sz);
+      chunks = prev;
+    }
+
+    free_list = nullptr;
+    chunk_cur_ptr = chunk_end_ptr = nullptr;
+  }
+
+  // Gives back to upstream the chunks none of whose blocks are allocated,
+  // newest first, except for up to `retained` bytes of them, which is
+  // reduced by the size of the chunks kept. Returns the number of bytes
+  // given back.
+  //
+  // Which chunks are free is found by counting the blocks of each chunk in
+  // the free list, so allocations and deallocations don't keep counts.
+  std::size_t trim(memory_resource *upstream, std::size_t &retained) noexcept
+  {
+    if (!chunks)
+      return 0;
+
+    for (auto chunk = chunks; chunk; chunk = chunk->prev)
+      chunk->free_blocks = 0;
+    for (auto block = free_list; block; block = block->next)
+      ++chunk_of(block)->free_blocks;
+
+    // Chunks to give back are marked by a count no chunk can have. Only the
+    // newest chunk may still be being carved.
+    constexpr auto released = std::numeric_limits<std::size_t>::max();
+    bool any_released = false;
+    for (auto chunk = chunks; chunk; chunk = chunk->prev)
+    {
+      const auto carved =
+        chunk == chunks && chunk_end_ptr
+          ? static_cast<std::size_t>(chunk_cur_ptr - base_of(chunk)) / blk_size
+          : chunk_blocks;
+      if (chunk->free_blocks != carved)
+        continue;
+      if (chunk_sz <= retained)
+        retained -= chunk_sz;
+      else
+      {
+        chunk->free_blocks = released;
+        any_released = true;
+      }
+    }
+
+    if (!any_released)
+      return 0;
+
+    auto link = &free_list;
+    while (*link)
+    {
+      if (chunk_of(*link)->free_blocks == released)
+        *link = (*link)->next;
+      else
+        link = &(*link)->next;
+    }
+
+    if (chunks->free_blocks == released)
+      chunk_cur_ptr = chunk_end_ptr = nullptr;
+
+    std::size_t bytes = 0;
+    auto chunk_link = &chunks;
+    while (*chunk_link)
+    {
+      const auto chunk = *chunk_link;
+      if (chunk->free_blocks != released)
+      {
+        chunk_link = &chunk->prev;
+        continue;
+      }
+      *chunk_link = chunk->prev;
+      asan_unpoison(base_of(chunk), chunk_sz);
+      upstream->deallocate(base_of(chunk), chunk_sz, chunk_sz);
+      bytes += chunk_sz;
+    }
+    return bytes;
+  }
+
+private:
+  std::byte *base_of(chunk_header *chunk) const noexcept
+  {
+    return reinterpret_cast<std::byte *>(chunk + 1) - chunk_sz;
+  }
+
+  // The smallest power of two that holds `max_blocks` blocks, within
+  // `max_pool_chunk_size`, but with room for at least one block and the
+  // header. The header takes the place of a block or so.
+  static std::size_t chunk_size_for(std::size_t block_size,
+                                    std::size_t max_blocks) noexcept
+  {
+    const auto wanted = std::min(block_size * max_blocks, max_pool_chunk_size);
+    return std::size_t(1)
+           << std::max(ceil_log2(wanted),
+                       ceil_log2(block_size + sizeof(chunk_header)));
+  }
+
+  // Obtains a new chunk from upstream. Blocks are handed out from it by
+  // bumping `chunk_cur_ptr`, so its memory isn't touched until it's used.
+  void replenish(memory_resource *upstream)
+  {
+    // Chunks are aligned to their size, which is a multiple of the blocks'
+    // alignment, so every block is naturally aligned to (at least) the
+    // largest power of two dividing its size.
+    const auto chunk_base_ptr =
+      static_cast<std::byte *>(upstream->allocate(chunk_sz, chunk_sz));
+    chunks = ::new (chunk_base_ptr + chunk_sz - sizeof(chunk_header))
+      chunk_header{chunks, this, 0};
+
+    chunk_cur_ptr = chunk_base_ptr;
+    chunk_end_ptr = chunk_base_ptr + chunk_blocks * blk_size;
+    asan_poison(chunk_cur_ptr, chunk_blocks * blk_size);
+  }
+
+  std::size_t blk_size; ///< Size of each block.
+  std::size_t chunk_sz; ///< Size and alignment of each chunk.
+  std::size_t chunk_blocks; ///< Number of blocks in a chunk.
+
+  pool_free_block *free_list = nullptr; ///< Deallocated blocks.
+  std::byte *chunk_cur_ptr = nullptr; ///< Untouched space in the last chunk.
+  std::byte *chunk_end_ptr = nullptr; ///< End of the last chunk's blocks.
+  chunk_header *chunks = nullptr; ///< Last allocated chunk.
+};
+
+// Keeps track of allocations that are too large for any pool, so they can be
+// released all at once. Each allocation is prefixed by a header linking it to
+// the others.
+class oversized_list
+{
+public:
+  oversized_list() = default;
+  oversized_list(const oversized_list &) = delete;
+  oversized_list &operator=(const oversized_list &) = delete;
+
+  void *allocate(memory_resource *upstream, std::size_t bytes,
+                 std::size_t alignment)
+  {
+    alignment = std::max(alignment, alignof(header));
+    const auto offset = round_up(sizeof(header), alignment);
+    const auto base_ptr =
+      static_cast<std::byte *>(upstream->allocate(offset + bytes, alignment));
+
+    auto h = ::new (base_ptr + offset - sizeof(header)) header;
+    h->prev = nullptr;
+    h->next = head;
+    h->size = offset + bytes;
+    h->alignment = alignment;
+    if (head)
+      head->prev = h;
+    head = h;
+    return base_ptr + offset;
+  }
+
+  void deallocate(memory_resource *upstream, void *p, std::size_t bytes,
+                  std::size_t alignment) noexcept
+  {
+    alignment = std::max(alignment, alignof(header));
+    const auto offset = round_up(sizeof(header), alignment);
+    const auto block_ptr = static_cast<std::byte *>(p);
+
+    auto h = reinterpret_cast<header *>(block_ptr - sizeof(header));
+    assert(h->size == offset + bytes && h->alignment == alignment);
+    if (h->prev)
+      h->prev->next = h->next;
+    else
+      head = h->next;
+    if (h->next)
+      h->next->prev = h->prev;
+
+    upstream->deallocate(block_ptr - offset, offset + bytes, alignment);
+  }
+
+  void release(memory_resource *upstream) noexcept
+  {
+    while (head)
+    {
+      const auto h = head;
+      head = h->next;
+      const auto offset = round_up(sizeof(header), h->alignment);
+      upstream->deallocate(reinterpret_cast<std::byte *>(h + 1) - offset,
+                           h->size, h->alignment);
+    }
+  }
+
+private:
+  struct header
+  {
+    header *prev;
+    header *next;
+    std::size_t size;
+    std::size_t alignment;
+  };
+
+  header *head = nullptr;
+};
+
+// Serializes every call to an upstream memory resource.
+class locked_resource final : public memory_resource
+{
+public:
+  explicit locked_resource(memory_resource *upstream) : upstream(upstream) {}
+
+  std::mutex &mutex() noexcept { return m; }
+
+private:
+  void *do_allocate(std::size_t bytes, std::size_t alignment) override
+  {
+    std::lock_guard<std::mutex> lock(m);
+    return upstream->allocate(bytes, alignment);
+  }
+
+  void do_deallocate(void *p, std::size_t bytes,
+                     std::size_t alignment) override
+  {
+    std::lock_guard<std::mutex> lock(m);
+    upstream->deallocate(p, bytes, alignment);
+  }
+
+  bool do_is_equal(const memory_resource &other) const noexcept override
+  {
+    return this == &other;
+  }
+
+  memory_resource *upstream;
+  std::mutex m;
+};
+
+// State that a resource keeps for each thread using it. It's shared between
+// the resource and the thread, so whichever goes away last destroys it.
+struct thread_cache_base
+{
+  virtual ~thread_cache_base() = default;
+
+  // Called from the thread's exit, while the resource may still be alive.
+  virtual void thread_exited() noexcept = 0;
+
+  void unref() noexcept
+  {
+    if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      delete this;
+  }
+
+  std::atomic<unsigned> refs{2};
+  std::atomic<bool> detached{false}; ///< Whether the resource is gone.
+};
+
+// Maps resources to the caches the calling thread has with them. Resources
+// are identified by a unique id, rather than by address, so that a resource
+// created at the address of a destroyed one never sees a stale cache.
+class thread_cache_registry
+{
+public:
+  static std::uint64_t next_id() noexcept
+  {
+    static std::atomic<std::uint64_t> id(0);
+    return id.fetch_add(1, std::memory_order_relaxed) + 1;
+  }
+
+  static thread_cache_registry &local() noexcept
+  {
+    static thread_local thread_cache_registry registry;
+    return registry;
+  }
+
+  thread_cache_registry() = default;
+  thread_cache_registry(const thread_cache_registry &) = delete;
+  thread_cache_registry &operator=(const thread_cache_registry &) = delete;
+
+  ~thread_cache_registry()
+  {
+    while (entries)
+    {
+      const auto e = entries;
+      entries = e->next;
+      e->cache->thread_exited();
+      e->cache->unref();
+      delete e;
+    }
+  }
+
+  thread_cache_base *find(std::uint64_t id) noexcept
+  {
+    if (id == last_id)
+      return last_cache;
+
+    for (auto e = entries; e; e = e->next)
+    {
+      if (e->id == id)
+      {
+        last_id = id;
+        last_cache = e->cache;
+        return e->cache;
+      }
+    }
+
+    return nullptr;
+  }
+
+  void insert(std::uint64_t id, thread_cache_base *cache)
+  {
+    prune();
+    entries = new entry{id, cache, entries};
+    last_id = id;
+    last_cache = cache;
+  }
+
+private:
+  struct entry
+  {
+    std::uint64_t id;
+    thread_cache_base *cache;
+    entry *next;
+  };
+
+  // Drops caches of resources that were destroyed.
+  void prune() noexcept
+  {
+    for (auto link = &entries; *link;)
+    {
+      const auto e = *link;
+      if (e->cache->detached.load(std::memory_order_acquire))
+      {
+        *link = e->next;
+        if (e->id == last_id)
+          last_id = 0;
+        e->cache->unref();
+        delete e;
+      }
+      else
+        link = &e->next;
+    }
+  }
+
+  std::uint64_t last_id = 0;
+  thread_cache_base *last_cache = nullptr;
+  entry *entries = nullptr;
+};
+
+// A thread cache kept in a thread_cache_list.
+struct listed_thread_cache : thread_cache_base
+{
+  void thread_exited() noexcept final
+  {
+    std::lock_guard<std::mutex> lock(m);
+    if (!detached.load(std::memory_order_relaxed))
+    {
+      flush();
+      orphaned = true;
+    }
+  }
+
+  // Called when the thread exits while the resource is still alive, so the
+  // cache can give back what it holds.
+  virtual void flush() noexcept {}
+
+  std::mutex m; ///< Serializes the thread's exit with the resource.
+  bool orphaned = false; ///< Whether the thread exited, so it's reusable.
+  listed_thread_cache *next_cache = nullptr; ///< Next cache of the resource.
+};
+
+// The caches of every thread using a resource. Only the thread owning a cache
+// touches it, except when it exits, or during for_each() and the list's
+// destruction, which lock the cache.
+template <class Cache>
+class thread_cache_list
+{
+public:
+  thread_cache_list() = default;
+  thread_cache_list(const thread_cache_list &) = delete;
+  thread_cache_list &operator=(const thread_cache_list &) = delete;
+
+  ~thread_cache_list()
+  {
+    std::lock_guard<std::mutex> lock(m);
+    while (caches)
+    {
+      const auto cache = caches;
+      caches = cache->next_cache;
+      {
+        std::lock_guard<std::mutex> cache_lock(cache->m);
+        cache->detached.store(true, std::memory_order_release);
+      }
+      cache->unref();
+    }
+  }
+
+  // Returns the calling thread's cache. `make` returns a unique_ptr to a new
+  // cache, and is only called the first time a thread asks for its cache,
+  // when there isn't one left by an exited thread to reuse.
+  template <class Make>
+  Cache &local(Make &&make)
+  {
+    auto &registry = thread_cache_registry::local();
+    if (auto cache = registry.find(id))
+      return static_cast<Cache &>(*cache);
+    return attach(registry, make);
+  }
+
+  // Returns the calling thread's cache, or null if it has none.
+  Cache *find_local() noexcept
+  {
+    return static_cast<Cache *>(thread_cache_registry::local().find(id));
+  }
+
+  // Calls `f` with every cache, locked.
+  template <class F>
+  void for_each(F &&f) const
+  {
+    std::lock_guard<std::mutex> lock(m);
+    for (auto cache = caches; cache; cache = cache->next_cache)
+    {
+      std::lock_guard<std::mutex> cache_lock(cache->m);
+      f(static_cast<Cache &>(*cache));
+    }
+  }
+
+private:
+  template <class Make>
+  Cache &attach(thread_cache_registry &registry, Make &make)
+  {
+    // Caches of exited threads are reused, so that threads coming and going
+    // don't pile up caches.
+    std::lock_guard<std::mutex> lock(m);
+    listed_thread_cache *cache = nullptr;
+    for (auto c = caches; c && !cache; c = c->next_cache)
+    {
+      std::lock_guard<std::mutex> cache_lock(c->m);
+      if (c->orphaned)
+      {
+        c->orphaned = false;
+        c->refs.fetch_add(1, std::memory_order_relaxed);
+        cache = c;
+      }
+    }
+
+    if (!cache)
+    {
+      std::unique_ptr<Cache> new_cache = make();
+      new_cache->next_cache = caches;
+      cache = caches = new_cache.release();
+    }
+
+    try
+    {
+      registry.insert(id, cache);
+    }
+    catch (...)
+    {
+      std::lock_guard<std::mutex> cache_lock(cache->m);
+      cache->orphaned = true;
+      cache->refs.fetch_sub(1, std::memory_order_relaxed);
+      throw;
+    }
+
+    return static_cast<Cache &>(*cache);
+  }
+
+  const std::uint64_t id = thread_cache_registry::next_id();
+  mutable std::mutex m; ///< Guards the list.
+  listed_thread_cache *caches = nullptr;
+};
+
+} // namespace detail
+
+// Each thread has its own cache of free blocks per pool, which allocations
+// and deallocations use without any synchronization. Caches are refilled
+// from, and overflow into, a shared depot per pool in batches, so shared
+// state is only touched once every few operations and never by a single
+// global lock. A block freed by a thread other than the one which allocated
+// it simply goes to the freeing thread's cache.
+class synchronized_pool_resource : public memory_resource
+{
+public:
+  synchronized_pool_resource(const pool_options &opts,
+                             memory_resource *upstream)
+    : upstream(upstream)
+    , locked_upstream(upstream)
+    , opts(detail::normalize_pool_options(opts))
+    , classes(this->opts)
+    , pool_count(classes.count())
+  {
+    assert(upstream);
+    this->opts.size_classes = classes.data();
+    this->opts.size_class_count = classes.data() ? pool_count : 0;
+    if (this->opts.histogram_samples != 0)
+      histogram = std::make_unique<detail::size_histogram>(
+        this->opts.largest_required_pool_block, this->opts.histogram_samples);
+
+    depots = std::make_unique<depot[]>(pool_count);
+    for (std::size_t i = 0; i < pool_count; ++i)
+      depots[i].pool.emplace(classes.block_size(i),
+                             this->opts.max_blocks_per_chunk);
+  }
+
+  synchronized_pool_resource()
+    : synchronized_pool_resource(pool_options(), get_default_resource())
+  {}
+  explicit synchronized_pool_resource(memory_resource *upstream)
+    : synchronized_pool_resource(pool_options(), upstream)
+  {}
+  explicit synchronized_pool_resource(const pool_options &opts)
+    : synchronized_pool_resource(opts, get_default_resource())
+  {}
+
+  synchronized_pool_resource(const synchronized_pool_resource &) = delete;
+
+  virtual ~synchronized_pool_resource() override { release(); }
+
+  synchronized_pool_resource &
+  operator=(const synchronized_pool_resource &) = delete;
+
+  // Must not be called concurrently with allocations or deallocations.
+  void release()
+  {
+    caches.for_each([this](thread_cache &cache) {
+      for (std::size_t i = 0; i < pool_count; ++i)
+        cache.lists[i] = {};
+    });
+
+    for (std::size_t i = 0; i < pool_count; ++i)
+    {
+      std::lock_guard<std::mutex> lock(depots[i].m);
+      depots[i].pool->release(&locked_upstream);
+    }
+
+    std::lock_guard<std::mutex> lock(locked_upstream.mutex());
+    oversized.release(upstream);
+  }
+
+  // Extension: gives back to upstream the pools' chunks none of whose blocks
+  // are allocated, except for up to `max_retained_bytes` of them, and returns
+  // how many bytes were given back. Blocks held in threads' caches count as
+  // allocated, except those of the calling thread, which are given back
+  // first. It may be called concurrently with allocations and deallocations.
+  //
+  // When upstream is a page_resource, the pages of the chunks go back to the
+  // system, as it unmaps them, or decommits the mappings it keeps.
+  std::size_t trim(std::size_t max_retained_bytes = 0) noexcept
+  {
+    if (const auto cache = caches.find_local())
+    {
+      for (std::size_t i = 0; i < pool_count; ++i)
+        flush(cache->lists[i], i, cache->lists[i].count);
+    }
+
+    std::size_t bytes = 0;
+    for (std::size_t i = 0; i < pool_count; ++i)
+    {
+      std::lock_guard<std::mutex> lock(depots[i].m);
+      bytes += depots[i].pool->trim(&locked_upstream, max_retained_bytes);
+    }
+    return bytes;
+  }
+
+  memory_resource *upstream_resource() const { return upstream; }
+  pool_options options() const { return opts; }
+
+  // Extension: writes up to `max_classes` block sizes to `out`, chosen so
+  // that the allocations recorded so far (see `histogram_samples`) waste the
+  // least memory in padding, and returns how many were written. The last one
+  // is always `largest_required_pool_block`. They're meant as the
+  // `size_classes` of a pool resource that serves the same workload.
+  std::size_t recommend_size_classes(std::size_t *out,
+                                     std::size_t max_classes) const
+  {
+    return histogram ? histogram->recommend(out, max_classes) : 0;
+  }
+
+  // Extension: number of allocations whose sizes were recorded.
+  std::size_t recorded_allocations() const noexcept
+  {
+    return histogram ? histogram->recorded_count() : 0;
+  }
+
+  // Non-virtual versions of `allocate` and `deallocate`, so they can be
+  // inlined when the resource type is known.
+  [[nodiscard]] void *allocate_fast(std::size_t bytes, std::size_t alignment)
+  {
+    if (histogram)
+      histogram->record(bytes);
+    const auto index = classes.index(bytes, alignment);
+    if (index >= pool_count)
+    {
+      std::lock_guard<std::mutex> lock(locked_upstream.mutex());
+      return oversized.allocate(upstream, bytes, alignment);
+    }
+
+    auto &list = local_cache().lists[index];
+    if (!list.head)
+      refill(list, index);
+
+    const auto block = list.head;
+    list.head = block->next;
+    --list.count;
+    detail::asan_unpoison(block, classes.block_size(index));
+    return block;
+  }
+
+  void deallocate_fast(void *p, std::size_t bytes, std::size_t alignment)
+  {
+    const auto index = classes.index(bytes, alignment);
+    if (index >= pool_count)
+    {
+      std::lock_guard<std::mutex> lock(locked_upstream.mutex());
+      return oversized.deallocate(upstream, p, bytes, alignment);
+    }
+
+    auto &list = local_cache().lists[index];
+    const auto block = static_cast<detail::pool_free_block *>(p);
+    block->next = list.head;
+    list.head = block;
+    detail::asan_poison_free_block(block, classes.block_size(index));
+    if (++list.count > 2 * batch_size(index))
+      overflow(list, index, batch_size(index));
+  }
+
+protected:
+  void *do_allocate(std::size_t bytes, std::size_t alignment) override
+  {
+    return allocate_fast(bytes, alignment);
+  }
+
+  void do_deallocate(void *p, std::size_t bytes,
+                     std::size_t alignment) override
+  {
+    deallocate_fast(p, bytes, alignment);
+  }
+
+  // Blocks are taken from the thread's cache, and what it lacks is taken
+  // from the depot under a single lock.
+  void do_allocate_bulk(void **out, std::size_t count, std::size_t bytes,
+                        std::size_t alignment) override
+  {
+    const auto index = classes.index(bytes, alignment);
+    if (index >= pool_count || count == 0)
+      return memory_resource::do_allocate_bulk(out, count, bytes, alignment);
+
+    auto &list = local_cache().lists[index];
+    std::size_t i = 0;
+    for (; i < count && list.head; ++i)
+    {
+      out[i] = list.head;
+      list.head = list.head->next;
+      --list.count;
+      detail::asan_unpoison(out[i], classes.block_size(index));
+    }
+
+    if (i < count)
+    {
+      try
+      {
+        auto &d = depots[index];
+        std::lock_guard<std::mutex> lock(d.m);
+        d.pool->allocate_bulk(&locked_upstream, out + i, count - i);
+      }
+      catch (...)
+      {
+        if (i > 0)
+          deallocate_bulk(out, i, bytes, alignment);
+        throw;
+      }
+    }
+  }
+
+  // Blocks are spliced onto the thread's cache at once, and the excess goes
+  // back to the depot under a single lock.
+  void do_deallocate_bulk(void *const *ptrs, std::size_t count,
+                          std::size_t bytes, std::size_t alignment) override
+  {
+    const auto index = classes.index(bytes, alignment);
+    if (index >= pool_count || count == 0)
+      return memory_resource::do_deallocate_bulk(ptrs, count, bytes,
+                                                 alignment);
+
+    auto &list = local_cache().lists[index];
+    detail::pool_free_block *last;
+    const auto first = detail::link_blocks(ptrs, count, last);
+    if constexpr (detail::asan_poisoning)
+    {
+      for (std::size_t i = 0; i < count; ++i)
+        detail::asan_poison_free_block(ptrs[i], classes.block_size(index));
+    }
+    last->next = list.head;
+    list.head = first;
+    list.count += count;
+    if (list.count > 2 * batch_size(index))
+      overflow(list, index, list.count - batch_size(index));
+  }
+
+  bool do_is_equal(const memory_resource &other) const noexcept override
+  {
+    return this == &other;
+  }
+
+private:
+  struct free_list
+  {
+    detail::pool_free_block *head = nullptr;
+    std::size_t count = 0;
+  };
+
+  // Free blocks a thread owns.
+  struct thread_cache final : detail::listed_thread_cache
+  {
+    thread_cache(synchronized_pool_resource *owner, std::size_t pool_count)
+      : owner(owner), lists(std::make_unique<free_list[]>(pool_count))
+    {}
+
+    // Gives every block back to the depots when the thread exits.
+    void flush() noexcept override
+    {
+      for (std::size_t i = 0; i < owner->pool_count; ++i)
+        owner->flush(lists[i], i, lists[i].count);
+    }
+
+    synchronized_pool_resource *owner;
+    std::unique_ptr<free_list[]> lists; ///< One list per pool.
+  };
+
+  // Blocks shared between threads for a given block size.
+  struct depot
+  {
+    std::mutex m;
+    std::optional<detail::block_pool> pool;
+  };
+
+  // Number of blocks moved between a thread cache and a depot at once. It
+  // shrinks as blocks get larger, so that caches don't hoard memory.
+  std::size_t batch_size(std::size_t index) const noexcept
+  {
+    const auto block_size = classes.block_size(index);
+    return std::clamp<std::size_t>(16384 / block_size, 2, 64);
+  }
+
+  thread_cache &local_cache()
+  {
+    return caches.local(
+      [this] { return std::make_unique<thread_cache>(this, pool_count); });
+  }
+
+  void refill(free_list &list, std::size_t index)
+  {
+    auto &d = depots[index];
+    std::lock_guard<std::mutex> lock(d.m);
+    list.head =
+      d.pool->allocate_batch(&locked_upstream, batch_size(index), list.count);
+  }
+
+  // Moves the first `n` blocks of a thread's list to the depot.
+  void flush(free_list &list, std::size_t index, std::size_t n) noexcept
+  {
+    if (n == 0)
+      return;
+
+    assert(n <= list.count);
+    const auto first = list.head;
+    auto last = first;
+    for (std::size_t i = 1; i < n; ++i)
+      last = last->next;
+    list.head = last->next;
+    list.count -= n;
+
+    auto &d = depots[index];
+    std::lock_guard<std::mutex> lock(d.m);
+    d.pool->deallocate_batch(first, last);
+  }
+
+  // Moves the first `n` blocks of a thread's list to the depot, as a
+  // deallocation overflows the cache, which counts towards decay.
+  void overflow(free_list &list, std::size_t index, std::size_t n) noexcept
+  {
+    flush(list, index, n);
+    if (opts.decay_interval != 0)
+    {
+      const auto before = flushed.fetch_add(n, std::memory_order_relaxed);
+      if (before / opts.decay_interval != (before + n) / opts.decay_interval)
+        trim(opts.decay_retained_bytes);
+    }
+  }
+
+  // Upstream memory resource from which we allocate chunks.
+  memory_resource *upstream;
+
+  // Upstream accesses are serialized, as its thread-safety isn't assumed.
+  detail::locked_resource locked_upstream;
+
+  pool_options opts; ///< Normalized options.
+  detail::size_class_table classes; ///< Block sizes of the pools.
+  std::size_t pool_count; ///< Number of pools, one per block size.
+  std::unique_ptr<detail::size_histogram> histogram; ///< Recorded sizes.
+  std::unique_ptr<depot[]> depots; ///< Shared pools ordered by block size.
+  detail::oversized_list oversized; ///< Allocations that don't fit a pool.
+  std::atomic<std::size_t> flushed{0}; ///< Blocks given back to the depots.
+
+  // Declared last, so that threads are detached before the depots they give
+  // blocks back to are destroyed.
+  detail::thread_cache_list<thread_cache> caches;
+};
+
+// [mem.res.pool.overview], pool resource classes
+//
+// Requests up to `largest_required_pool_block` bytes are served by pools of
+// power-of-two sized blocks, or of the sizes in `size_classes`. Any larger
+// request goes straight to upstream.
+//
+// Blocks are aligned to the largest power of two dividing their size, so a
+// request aligned to `cache_line_size` gets cache lines of its own, in both
+// pool resources. They have no header either, as deallocations are given the
+// size, so a 16-byte request takes 16 bytes.
+class unsynchronized_pool_resource : public memory_resource
+{
+public:
+  unsynchronized_pool_resource(const pool_options &opts,
+                               memory_resource *upstream)
+    : upstream(upstream)
+    , opts(detail::normalize_pool_options(opts))
+    , classes(this->opts)
+    , pool_count(classes.count())
+  {
+    assert(upstream);
+    this->opts.size_classes = classes.data();
+    this->opts.size_class_count = classes.data() ? pool_count : 0;
+    if (this->opts.histogram_samples != 0)
+      histogram = std::make_unique<detail::size_histogram>(
+        this->opts.largest_required_pool_block, this->opts.histogram_samples);
+  }
+
+  unsynchronized_pool_resource()
+    : unsynchronized_pool_resource(pool_options(), get_default_resource())
+  {}
+  explicit unsynchronized_pool_resource(memory_resource *upstream)
+    : unsynchronized_pool_resource(pool_options(), upstream)
+  {}
+  explicit unsynchronized_pool_resource(const pool_options &opts)
+    : unsynchronized_pool_resource(opts, get_default_resource())
+  {}
+
+  unsynchronized_pool_resource(const unsynchronized_pool_resource &) = delete;
+  virtual ~unsynchronized_pool_resource() override { release(); }
+
+  unsynchronized_pool_resource &
+  operator=(const unsynchronized_pool_resource &) = delete;
+
+  void release()
+  {
+    if (pools)
+    {
+      for (std::size_t i = 0; i < pool_count; ++i)
+      {
+        pools[i].release(upstream);
+        pools[i].~block_pool();
+      }
+      upstream->deallocate(pools, pool_count * sizeof(detail::block_pool),
+                           alignof(detail::block_pool));
+      pools = nullptr;
+    }
+
+    oversized.release(upstream);
+  }
+
+  // Extension: gives back to upstream the pools' chunks none of whose blocks
+  // are allocated, except for up to `max_retained_bytes` of them, and returns
+  // how many bytes were given back.
+  //
+  // When upstream is a page_resource, the pages of the chunks go back to the
+  // system, as it unmaps them, or decommits the mappings it keeps.
+  std::size_t trim(std::size_t max_retained_bytes = 0) noexcept
+  {
+    if (!pools)
+      return 0;
+
+    std::size_t bytes = 0;
+    for (std::size_t i = 0; i < pool_count; ++i)
+      bytes += pools[i].trim(upstream, max_retained_bytes);
+    return bytes;
+  }
+
+  memory_resource *upstream_resource() const { return upstream; }
+  pool_options options() const { return opts; }
+
+  // Extension: writes up to `max_classes` block sizes to `out`, chosen so
+  // that the allocations recorded so far (see `histogram_samples`) waste the
+  // least memory in padding, and returns how many were written. The last one
+  // is always `largest_required_pool_block`. They're meant as the
+  // `size_classes` of a pool resource that serves the same workload.
+  std::size_t recommend_size_classes(std::size_t *out,
+                                     std::size_t max_classes) const
+  {
+    return histogram ? histogram->recommend(out, max_classes) : 0;
+  }
+
+  // Extension: number of allocations whose sizes were recorded.
+  std::size_t recorded_allocations() const noexcept
+  {
+    return histogram ? histogram->recorded_count() : 0;
+  }
+
+  // Non-virtual versions of `allocate` and `deallocate`, so they can be
+  // inlined when the resource type is known.
+  [[nodiscard]] void *allocate_fast(std::size_t bytes, std::size_t alignment)
+  {
+    if (histogram)
+      histogram->record(bytes);
+    const auto index = classes.index(bytes, alignment);
+    if (index >= pool_count)
+      return oversized.allocate(upstream, bytes, alignment);
+
+    if (!pools)
+      create_pools();
+    return pools[index].allocate(upstream);
+  }
+
+  void deallocate_fast(void *p, std::size_t bytes, std::size_t alignment)
+  {
+    const auto index = classes.index(bytes, alignment);
+    if (index >= pool_count)
+      return oversized.deallocate(upstream, p, bytes, alignment);
+
+    assert(pools);
+    pools[index].deallocate(p);
+    if (opts.decay_interval != 0)
+      count_deallocations(1);
+  }
+
+protected:
+  void *do_allocate(std::size_t bytes, std::size_t alignment) override
+  {
+    return allocate_fast(bytes, alignment);
+  }
+
+  void do_deallocate(void *p, std::size_t bytes,
+                     std::size_t alignment) override
+  {
+    deallocate_fast(p, bytes, alignment);
+  }
+
+  void do_allocate_bulk(void **out, std::size_t count, std::size_t bytes,
+                        std::size_t alignment) override
+  {
+    const auto index = classes.index(bytes, alignment);
+    if (index >= pool_count || count == 0)
+      return memory_resource::do_allocate_bulk(out, count, bytes, alignment);
+
+    if (!pools)
+      create_pools();
+    pools[index].allocate_bulk(upstream, out, count);
+  }
+
+  // Blocks are linked together and spliced onto the pool's free list at
+  // once.
+  void do_deallocate_bulk(void *const *ptrs, std::size_t count,
+                          std::size_t bytes, std::size_t alignment) override
+  {
+    const auto index = classes.index(bytes, alignment);
+    if (index >= pool_count || count == 0)
+      return memory_resource::do_deallocate_bulk(ptrs, count, bytes,
+                                                 alignment);
+
+    assert(pools);
+    detail::pool_free_block *last;
+    const auto first = detail::link_blocks(ptrs, count, last);
+    if constexpr (detail::asan_poisoning)
+    {
+      for (std::size_t i = 0; i < count; ++i)
+        detail::asan_poison_free_block(ptrs[i], classes.block_size(index));
+    }
+    pools[index].deallocate_batch(first, last);
+    if (opts.decay_interval != 0)
+      count_deallocations(count);
+  }
+
+  bool do_is_equal(const memory_resource &other) const noexcept override
+  {
+    return this == &other;
+  }
+
+private:
+  void count_deallocations(std::size_t n) noexcept
+  {
+    deallocations += n;
+    if (deallocations >= opts.decay_interval)
+    {
+      deallocations = 0;
+      trim(opts.decay_retained_bytes);
+    }
+  }
+
+  // Pools are created lazily, so that constructing a pool resource doesn't
+  // touch upstream.
+  void create_pools()
+  {
+    pools = static_cast<detail::block_pool *>(
+      upstream->allocate(pool_count * sizeof(detail::block_pool),
+                         alignof(detail::block_pool)));
+    for (std::size_t i = 0; i < pool_count; ++i)
+      ::new (&pools[i])
+        detail::block_pool(classes.block_size(i), opts.max_blocks_per_chunk);
+  }
+
+  // Upstream memory resource from which we allocate chunks.
+  memory_resource *upstream;
+
+  pool_options opts; ///< Normalized options.
+  detail::size_class_table classes; ///< Block sizes of the pools.
+  std::size_t pool_count; ///< Number of pools, one per block size.
+  std::unique_ptr<detail::size_histogram> histogram; ///< Recorded sizes.
+  detail::block_pool *pools = nullptr; ///< Pools ordered by block size.
+  detail::oversized_list oversized; ///< Allocations that don't fit a pool.
+  std::size_t deallocations = 0; ///< Since the last decay.
+};
+
+// A memory resource for blocks of a single size and alignment, both known at
+// compile time, such as the nodes of a node-based container. Freed blocks are
+// kept in an intrusive list and reused first, and new ones are carved out of
+// chunks obtained from upstream, whose sizes follow a geometric progression.
+// There's no size class to look up, so, through resource_allocator, an
+// allocation is a few inlined instructions.
+//
+// Requests larger than `BlockSize`, or more aligned than `Align`, go straight
+// to upstream, and aren't affected by release(). Like
+// unsynchronized_pool_resource, it isn't thread-safe.
+template <std::size_t BlockSize, std::size_t Align = alignof(std::max_align_t)>
+class fixed_block_resource : public memory_resource
+{
+  static_assert(BlockSize > 0, "block size must not be zero");
+  static_assert(Align > 0 && (Align & (Align - 1)) == 0,
+                "alignment must be a power of two");
+
+public:
+  // Alignment of the blocks, which must also be able to hold a free list
+  // link.
+  static constexpr std::size_t block_alignment =
+    std::max(Align, alignof(detail::pool_free_block));
+
+  // Size of the blocks, rounded up so that consecutive blocks stay aligned.
+  static constexpr std::size_t block_size = detail::round_up(
+    std::max(BlockSize, detail::min_pool_block_size), block_alignment);
+
+  explicit fixed_block_resource(
+    memory_resource *upstream,
+    std::size_t max_blocks_per_chunk = detail::default_max_blocks_per_chunk)
+    : upstream(upstream)
+    , max_blocks(std::max<std::size_t>(max_blocks_per_chunk, 1))
+    , next_blocks(std::min(detail::initial_blocks_per_chunk, max_blocks))
+  {
+    assert(upstream);
+  }
+
+  fixed_block_resource() : fixed_block_resource(get_default_resource()) {}
+
+  fixed_block_resource(const fixed_block_resource &) = delete;
+  virtual ~fixed_block_resource() override { release(); }
+
+  fixed_block_resource &operator=(const fixed_block_resource &) = delete;
+
+  // Gives every chunk back to upstream, regardless of whether its blocks were
+  // deallocated.
+  void release() noexcept
+  {
+    while (chunks)
+    {
+      const auto header = *chunks;
+      const auto chunk_base_ptr =
+        reinterpret_cast<std::byte *>(chunks) + sizeof(chunk_header) -
+        header.size;
+      detail::asan_unpoison(chunk_base_ptr, header.size - sizeof(chunk_header));
+      upstream->deallocate(chunk_base_ptr, header.size, block_alignment);
+      chunks = header.prev;
+    }
+
+    free_list = nullptr;
+    chunk_cur_ptr = chunk_end_ptr = nullptr;
+    next_blocks = std::min(detail::initial_blocks_per_chunk, max_blocks);
+  }
+
+  memory_resource *upstream_resource() const { return upstream; }
+
+  // Non-virtual versions of `allocate` and `deallocate`, so they can be
+  // inlined when the resource type is known.
+  [[nodiscard]] void *allocate_fast(std::size_t bytes = BlockSize,
+                                    std::size_t alignment = Align)
+  {
+    if (bytes > BlockSize || alignment > Align)
+      return upstream->allocate(bytes, alignment);
+
+    if (free_list)
+    {
+      auto block = free_list;
+      free_list = block->next;
+      detail::asan_unpoison(block, block_size);
+      return block;
+    }
+
+    if (chunk_cur_ptr == chunk_end_ptr)
+      replenish();
+
+    void *block = chunk_cur_ptr;
+    chunk_cur_ptr += block_size;
+    detail::asan_unpoison(block, block_size);
+    return block;
+  }
+
+  void deallocate_fast(void *p, std::size_t bytes = BlockSize,
+                       std::size_t alignment = Align)
+  {
+    if (bytes > BlockSize || alignment > Align)
+      return upstream->deallocate(p, bytes, alignment);
+
+    auto block = static_cast<detail::pool_free_block *>(p);
+    block->next = free_list;
+    free_list = block;
+    detail::asan_poison_free_block(block, block_size);
+  }
+
+protected:
+  void *do_allocate(std::size_t bytes, std::size_t alignment) override
+  {
+    return allocate_fast(bytes, alignment);
+  }
+
+  void do_deallocate(void *p, std::size_t bytes,
+                     std::size_t alignment) override
+  {
+    deallocate_fast(p, bytes, alignment);
+  }
+
+  bool do_is_equal(const memory_resource &other) const noexcept override
+  {
+    return this == &other;
+  }
+
+private:
+  // Information about a chunk, stored right after its last block. Chunks are
+  // linked together so they can be released.
+  struct chunk_header
+  {
+    chunk_header *prev;
+    std::size_t size;
+  };
+
+  static_assert(alignof(chunk_header) <= block_alignment,
+                "chunk headers must be aligned after any block");
+
+  // Obtains a new chunk from upstream. Kept out of the fast path, so that
+  // allocate_fast stays small enough to be inlined.
+  void replenish()
+  {
+    const auto blocks_size = next_blocks * block_size;
+    const auto chunk_size = blocks_size + sizeof(chunk_header);
+    const auto chunk_base_ptr = static_cast<std::byte *>(
+      upstream->allocate(chunk_size, block_alignment));
+    chunks =
+      ::new (chunk_base_ptr + blocks_size) chunk_header{chunks, chunk_size};
+
+    chunk_cur_ptr = chunk_base_ptr;
+    chunk_end_ptr = chunk_base_ptr + blocks_size;
+    detail::asan_poison(chunk_cur_ptr, blocks_size);
+    next_blocks = std::min(next_blocks * 2, max_blocks);
+  }
+
+  // Upstream memory resource from which we allocate chunks.
+  memory_resource *upstream;
+
+  std::size_t max_blocks; ///< Maximum number of blocks in a chunk.
+  std::size_t next_blocks; ///< Number of blocks in the next chunk.
+
+  detail::pool_free_block *free_list = nullptr; ///< Deallocated blocks.
+  std::byte *chunk_cur_ptr = nullptr; ///< Untouched space in the last chunk.
+  std::byte *chunk_end_ptr = nullptr; ///< End of the last chunk's blocks.
+  chunk_header *chunks = nullptr; ///< Last allocated chunk.
+};
+
+// Size of the blocks of memory that are shared between cores, so that writes
+// from different threads to the same block cause false sharing. It's the same
+// as `std::hardware_destructive_interference_size` on most targets, but that
+// one's value depends on tuning flags, so it isn't used here; define
+// FEROLDI_PMR_CACHE_LINE_SIZE to override it.
+#if defined(FEROLDI_PMR_CACHE_LINE_SIZE)
+inline constexpr std::size_t cache_line_size = FEROLDI_PMR_CACHE_LINE_SIZE;
+#else
+inline constexpr std::size_t cache_line_size = 64;
+#endif
+
+// A memory resource adaptor which gives every allocation cache lines of its
+// own, by aligning it to `cache_line_size` and rounding its size up to whole
+// lines, before forwarding it to upstream. It's meant for the objects written
+// by different threads, such as per-thread counters and queues, so that only
+// they pay for the isolation.
+class cacheline_isolating_resource : public memory_resource
+{
+public:
+  explicit cacheline_isolating_resource(memory_resource *upstream) noexcept
+    : upstream(upstream)
+  {
+    assert(upstream);
+  }
+
+  cacheline_isolating_resource() noexcept
+    : cacheline_isolating_resource(get_default_resource())
+  {}
+
+  memory_resource *upstream_resource() const { return upstream; }
+
+protected:
+  void *do_allocate(std::size_t bytes, std::size_t alignment) override
+  {
+    return upstream->allocate(isolated_size(bytes),
+                              std::max(alignment, cache_line_size));
+  }
+
+  void do_deallocate(void *p, std::size_t bytes,
+                     std::size_t alignment) override
+  {
+    upstream->deallocate(p, isolated_size(bytes),
+                         std::max(alignment, cache_line_size));
+  }
+
+  bool do_is_equal(const memory_resource &other) const noexcept override
+  {
+    if (this == &other)
+      return true;
+    const auto r = dynamic_cast<const cacheline_isolating_resource *>(&other);
+    return r && *r->upstream == *upstream;
+  }
+
+private:
+  static std::size_t isolated_size(std::size_t bytes) noexcept
+  {
+    return detail::round_up(std::max<std::size_t>(bytes, 1), cache_line_size);
+  }
+
+  memory_resource *upstream;
+};
+
+namespace detail {
+constexpr std::size_t default_monotonic_initial_size = 4096;
+} // namespace detail
+
+// Options for how a monotonic_buffer_resource grows its regions.
+struct monotonic_options
+{
+  // Size of the first region obtained from upstream. Zero means an
+  // implementation-defined default.
+  std::size_t initial_size = 0;
+
+  // Each region is this many times larger than the previous one. Must be at
+  // least 1.
+  double growth_factor = 2.0;
+
+  // Regions never grow past this size, except for single allocations that
+  // don't fit in it. Zero means regions grow without bound.
+  std::size_t max_region_size = 0;
+
+  // Allocations of at least this many bytes which don't fit the current
+  // region get a region of their own, without affecting the size of the
+  // regions that come after it. Zero disables this.
+  std::size_t huge_allocation_threshold = 0;
+
+  // Up to this many bytes of regions are kept, instead of being given back to
+  // upstream, when they're released (by release(), rewind() or reset()). New
+  // regions are then taken from them first, so their memory is already
+  // faulted in. Zero means every region is given back.
+  std::size_t max_retained_bytes = 0;
+
+  // Alignment at which regions are obtained from upstream, such as the page
+  // size, for regions that are whole pages. Zero means
+  // `alignof(std::max_align_t)`. Must be a power of two.
+  std::size_t region_alignment = 0;
+
+  // Whether region headers go at the end of regions rather than at their
+  // start, so that the first allocation from a region gets the region's own
+  // alignment, without any padding.
+  bool header_at_end = false;
+
+  // Whether requests aligned to at least `cache_line_size` also have their
+  // size rounded up to whole cache lines, so that no other allocation shares
+  // a line with them. Objects written by different threads can then be kept
+  // from false sharing by asking for that alignment, without inflating any
+  // other allocation.
+  bool isolate_cache_lines = false;
+};
+
+// Usage statistics of a monotonic_buffer_resource's regions in use. Bytes an
+// allocation skips for alignment are counted in `used_bytes`, so when the
+// resource sits behind a statistics_resource, its `bytes_allocated` tells
+// how many of them were actually requested.
+struct monotonic_statistics
+{
+  std::size_t regions = 0; ///< Regions in use, including an initial buffer.
+  std::size_t region_bytes = 0; ///< Total size of the regions.
+  std::size_t header_bytes = 0; ///< Bytes taken by region headers.
+  std::size_t used_bytes = 0; ///< Bytes handed out, including padding.
+
+  // Free bytes at the end of regions which were left for a new one, and so
+  // won't ever be used.
+  std::size_t wasted_tail_bytes = 0;
+
+  std::size_t free_bytes = 0; ///< Free bytes in the current region.
+  std::size_t retained_bytes = 0; ///< Bytes of retained regions.
+};
+
+class monotonic_buffer_resource : public memory_resource
+{
+public:
+  explicit monotonic_buffer_resource(memory_resource *mr) : upstream(mr) {}
+
+  monotonic_buffer_resource(std::size_t initial_size, memory_resource *mr)
+    : upstream(mr), next_region_size(initial_size)
+  {
+    assert(initial_size > 0);
+  }
+
+  monotonic_buffer_resource(void *buffer, std::size_t buffer_size,
+                            memory_resource *mr)
+    : upstream(mr)
+    , region_base_ptr(reinterpret_cast<std::byte *>(buffer))
+    , region_cur_ptr(reinterpret_cast<std::byte *>(buffer))
+    , region_end_ptr(reinterpret_cast<std::byte *>(buffer) + buffer_size)
+    , region_limit_ptr(region_end_ptr)
+    , next_region_size(compute_next_grow(buffer_size))
+  {
+    assert(buffer_size > 0);
+    poison_free_space();
+  }
+
+  monotonic_buffer_resource(const monotonic_options &opts,
+                            memory_resource *mr)
+    : upstream(mr)
+    , opts(opts)
+    , next_region_size(opts.initial_size != 0
+                         ? opts.initial_size
+                         : detail::default_monotonic_initial_size)
+  {
+    assert(opts.growth_factor >= 1.0);
+    assert((opts.region_alignment & (opts.region_alignment - 1)) == 0);
+  }
+
+  monotonic_buffer_resource(void *buffer, std::size_t buffer_size,
+                            const monotonic_options &opts,
+                            memory_resource *mr)
+    : upstream(mr)
+    , opts(opts)
+    , region_base_ptr(reinterpret_cast<std::byte *>(buffer))
+    , region_cur_ptr(reinterpret_cast<std::byte *>(buffer))
+    , region_end_ptr(reinterpret_cast<std::byte *>(buffer) + buffer_size)
+    , region_limit_ptr(region_end_ptr)
+    , next_region_size(opts.initial_size != 0 ? opts.initial_size
+                                              : compute_next_grow(buffer_size))
+  {
+    assert(buffer_size > 0);
+    assert(opts.growth_factor >= 1.0);
+    assert((opts.region_alignment & (opts.region_alignment - 1)) == 0);
+    poison_free_space();
+  }
+
+  explicit monotonic_buffer_resource(const monotonic_options &opts)
+    : monotonic_buffer_resource(opts, get_default_resource())
+  {}
+
+  monotonic_buffer_resource()
+    : monotonic_buffer_resource(get_default_resource())
+  {}
+
+  explicit monotonic_buffer_resource(std::size_t initial_size)
+    : monotonic_buffer_resource(initial_size, get_default_resource())
+  {}
+
+  monotonic_buffer_resource(void *buffer, std::size_t buffer_size)
+    : monotonic_buffer_resource(buffer, buffer_size, get_default_resource())
+  {}
+
+  monotonic_buffer_resource(const monotonic_buffer_resource &) = delete;
+
+  virtual ~monotonic_buffer_resource() override
+  {
+    release();
+    trim();
+
+    // The initial buffer goes back to its owner as it was given.
+    detail::asan_unpoison(region_base_ptr,
+                          static_cast<std::size_t>(region_end_ptr -
+                                                   region_base_ptr));
+  }
+
+  monotonic_buffer_resource &
+  operator=(const monotonic_buffer_resource &) = delete;
+
+  void release()
+  {
+    destroy_objects(nullptr);
+
+    // Deallocates all regions by walking backwards in the list. Stops walking
+    // if we hit a buffer we don't own, or when there aren't any more regions.
+    while (owns_region && region_base_ptr)
+      pop_region();
+    discard_spare_region();
+
+    assert(!owns_region);
+    region_cur_ptr = region_base_ptr;
+    poison_free_space();
+  }
+
+  // Gives retained regions back to upstream, until at most `max_retained`
+  // bytes of them are left.
+  void trim(std::size_t max_retained = 0)
+  {
+    while (retained_bytes > max_retained)
+    {
+      const auto header = read_header(retained_base_ptr, retained_end_ptr);
+      const auto size =
+        static_cast<std::size_t>(retained_end_ptr - retained_base_ptr);
+      upstream->deallocate(retained_base_ptr, size, region_alignment());
+      retained_bytes -= size;
+      retained_base_ptr = header.prev_region_base_ptr;
+      retained_end_ptr = header.prev_region_end_ptr;
+    }
+  }
+
+  // Number of bytes of released regions kept for reuse.
+  std::size_t retained_size() const noexcept { return retained_bytes; }
+
+  // Extension: whether `p` points into one of the regions in use, or into
+  // the initial buffer. It walks the regions, which are few when they grow
+  // geometrically.
+  bool owns(const void *p) const noexcept
+  {
+    const auto q = static_cast<const std::byte *>(p);
+    const std::less<const std::byte *> less;
+
+    auto base_ptr = region_base_ptr;
+    auto end_ptr = region_end_ptr;
+    auto owned = owns_region;
+    while (base_ptr)
+    {
+      if (!less(q, base_ptr) && less(q, end_ptr))
+        return true;
+      if (!owned)
+        break;
+
+      const auto header = read_header(base_ptr, end_ptr);
+      base_ptr = header.prev_region_base_ptr;
+      end_ptr = header.prev_region_end_ptr;
+      owned = header.owns_prev_region;
+    }
+    return false;
+  }
+
+  // Walks all regions in use to gather statistics about them. It doesn't
+  // cost anything until it's called.
+  monotonic_statistics statistics() const noexcept
+  {
+    monotonic_statistics stats;
+    stats.retained_bytes = retained_bytes;
+    if (region_base_ptr)
+      stats.free_bytes =
+        static_cast<std::size_t>(region_limit_ptr - region_cur_ptr);
+
+    auto base_ptr = region_base_ptr;
+    auto cur_ptr = region_cur_ptr;
+    auto end_ptr = region_end_ptr;
+    auto owned = owns_region;
+    bool is_current = true;
+    while (base_ptr)
+    {
+      ++stats.regions;
+      stats.region_bytes += static_cast<std::size_t>(end_ptr - base_ptr);
+      const auto limit_ptr = owned ? end_ptr - tail_offset() : end_ptr;
+      if (!is_current)
+        stats.wasted_tail_bytes +=
+          static_cast<std::size_t>(limit_ptr - cur_ptr);
+
+      if (!owned)
+      {
+        stats.used_bytes += static_cast<std::size_t>(cur_ptr - base_ptr);
+        break;
+      }
+
+      stats.header_bytes += sizeof(owned_region_header);
+      stats.used_bytes +=
+        static_cast<std::size_t>(cur_ptr - base_ptr - front_offset());
+
+      const auto header = read_header(base_ptr, end_ptr);
+      base_ptr = header.prev_region_base_ptr;
+      cur_ptr = header.prev_region_cur_ptr;
+      end_ptr = header.prev_region_end_ptr;
+      owned = header.owns_prev_region;
+      is_current = false;
+    }
+
+    return stats;
+  }
+
+  // A point in the allocation history of a monotonic_buffer_resource, which
+  // it can be rewound to.
+  class checkpoint
+  {
+    friend class monotonic_buffer_resource;
+
+    std::byte *region_base_ptr;
+    std::byte *region_cur_ptr;
+    std::byte *prev_region_base_ptr;
+    std::size_t next_region_size;
+    void *destructors; ///< Newest object created before the mark.
+  };
+
+  // Records the current state of the resource, so that every allocation made
+  // after it can be undone at once by rewind().
+  checkpoint mark() const noexcept
+  {
+    checkpoint cp;
+    cp.region_base_ptr = region_base_ptr;
+    cp.region_cur_ptr = region_cur_ptr;
+    cp.prev_region_base_ptr = nullptr;
+    cp.next_region_size = next_region_size;
+    cp.destructors = destructors;
+    if (owns_region)
+      cp.prev_region_base_ptr =
+        read_header(region_base_ptr, region_end_ptr).prev_region_base_ptr;
+    return cp;
+  }
+
+  // Gives back all memory allocated since `cp` was marked. Regions obtained
+  // after it are returned to upstream, and allocation continues right where
+  // it was at the time of the mark.
+  //
+  // Checkpoints marked after `cp` are invalidated, as are all of them by
+  // release() and reset().
+  void rewind(const checkpoint &cp)
+  {
+    destroy_objects(static_cast<destructor_record *>(cp.destructors));
+
+    while (region_base_ptr != cp.region_base_ptr)
+    {
+      assert(owns_region && "checkpoint is not from this resource");
+      pop_region();
+    }
+
+    // Huge allocations may have been given regions of their own, linked right
+    // behind the checkpoint's region.
+    if (owns_region)
+    {
+      auto header = read_header(region_base_ptr, region_end_ptr);
+      while (header.prev_region_base_ptr != cp.prev_region_base_ptr)
+      {
+        assert(header.owns_prev_region);
+        const auto prev_header = read_header(header.prev_region_base_ptr,
+                                             header.prev_region_end_ptr);
+        discard_region(header.prev_region_base_ptr,
+                       static_cast<std::size_t>(header.prev_region_end_ptr -
+                                                header.prev_region_base_ptr));
+        header = prev_header;
+      }
+      write_header(region_base_ptr, region_end_ptr, header);
+    }
+
+    region_cur_ptr = cp.region_cur_ptr;
+    next_region_size = cp.next_region_size;
+    poison_free_space();
+  }
+
+  // Like release(), except the largest region obtained from upstream is kept
+  // and reused for the allocations that follow, instead of being given back.
+  // With an initial buffer, allocation starts over from the buffer, and the
+  // kept region is taken up once the buffer runs out.
+  void reset()
+  {
+    destroy_objects(nullptr);
+
+    // Finds the largest owned region, and the region we don't own (if any) at
+    // the end of the list.
+    std::byte *largest_base_ptr = nullptr;
+    std::size_t largest_size = 0;
+    {
+      auto base_ptr = region_base_ptr;
+      auto end_ptr = region_end_ptr;
+      auto owned = owns_region;
+      while (owned && base_ptr)
+      {
+        const auto size = static_cast<std::size_t>(end_ptr - base_ptr);
+        if (size > largest_size)
+        {
+          largest_base_ptr = base_ptr;
+          largest_size = size;
+        }
+        const auto header = read_header(base_ptr, end_ptr);
+        base_ptr = header.prev_region_base_ptr;
+        end_ptr = header.prev_region_end_ptr;
+        owned = header.owns_prev_region;
+      }
+    }
+
+    while (owns_region && region_base_ptr)
+    {
+      if (region_base_ptr == largest_base_ptr)
+        skip_region();
+      else
+        pop_region();
+    }
+
+    assert(!owns_region);
+    region_cur_ptr = region_base_ptr;
+    if (largest_base_ptr && region_base_ptr)
+    {
+      // The initial buffer can't be put behind the kept region, so the region
+      // is set aside instead, unless the one already set aside is larger.
+      if (largest_size > spare_size)
+      {
+        discard_spare_region();
+        set_aside_region(largest_base_ptr, largest_size);
+      }
+      else
+        discard_region(largest_base_ptr, largest_size);
+    }
+    else if (largest_base_ptr)
+    {
+      // The kept region goes back on top of the list.
+      push_region(largest_base_ptr, largest_size);
+    }
+    poison_free_space();
+  }
+
+  // Grows the most recent allocation, `p` of `old_bytes`, to `new_bytes`
+  // without moving it, if the current region has room for it. Returns whether
+  // it did; otherwise, `p` keeps its size.
+  bool try_expand(void *p, std::size_t old_bytes,
+                  std::size_t new_bytes) noexcept
+  {
+    assert(new_bytes >= old_bytes);
+    if (!is_last_allocation(p, old_bytes) ||
+        new_bytes - old_bytes >
+          static_cast<std::size_t>(region_limit_ptr - region_cur_ptr))
+      return false;
+
+    detail::asan_unpoison(region_cur_ptr, new_bytes - old_bytes);
+    region_cur_ptr = static_cast<std::byte *>(p) + new_bytes;
+    return true;
+  }
+
+  // Shrinks the most recent allocation, `p` of `old_bytes`, to `new_bytes`,
+  // giving the rest back to the current region. Returns whether it did, which
+  // it can't for any other allocation; `p` is still usable either way.
+  bool try_shrink(void *p, std::size_t old_bytes,
+                  std::size_t new_bytes) noexcept
+  {
+    assert(new_bytes <= old_bytes);
+    if (!is_last_allocation(p, old_bytes))
+      return false;
+
+    region_cur_ptr = static_cast<std::byte *>(p) + new_bytes;
+    poison_free_space();
+    return true;
+  }
+
+  memory_resource *upstream_resource() const { return upstream; }
+  monotonic_options options() const { return opts; }
+
+  // Allocates like `allocate`, except it isn't virtual, so it can be inlined
+  // when the resource type is known. Space in the current region is handed out
+  // by aligning and bumping a pointer, and only when there isn't enough space
+  // left does it fall back to obtaining a new region from upstream.
+  //
+  // `alignment` must be a power of two.
+  [[nodiscard]] void *
+  allocate_fast(std::size_t bytes,
+                std::size_t alignment = alignof(std::max_align_t))
+  {
+    assert(alignment > 0 && (alignment & (alignment - 1)) == 0);
+    if (alignment >= cache_line_size && opts.isolate_cache_lines)
+      bytes = detail::round_up(bytes, cache_line_size);
+    if (const auto p = bump(bytes, alignment))
+      return p;
+    return allocate_from_new_region(bytes, alignment);
+  }
+
+  template <std::size_t Alignment>
+  [[nodiscard]] void *allocate_fast(std::size_t bytes)
+  {
+    static_assert(Alignment > 0 && (Alignment & (Alignment - 1)) == 0,
+                  "alignment must be a power of two");
+    return allocate_fast(bytes, Alignment);
+  }
+
+  void deallocate_fast(void *, std::size_t, std::size_t) noexcept
+  {
+    // Do nothing.
+  }
+
+  // Extension: allocates and constructs a `T` from `args`, with uses-allocator
+  // construction, as `polymorphic_allocator::construct` does, so that it
+  // allocates from this resource too if it takes an allocator.
+  //
+  // Unless `T` is trivially destructible, its destructor is registered in a
+  // list kept in the resource's own memory, and run by release(), reset()
+  // and rewind() (for objects created after the checkpoint), or by the
+  // resource's destruction, newest object first. A whole object graph then
+  // goes away at once, without destroying each object by hand.
+  template <class T, class... Args>
+  T *create(Args &&... args)
+  {
+    destructor_record *record = nullptr;
+    if constexpr (!std::is_trivially_destructible_v<T>)
+      record = static_cast<destructor_record *>(
+        allocate_fast(sizeof(destructor_record), alignof(destructor_record)));
+
+    // The record is taken first, so that once the object is constructed,
+    // registering it can't fail.
+    const auto p = static_cast<T *>(allocate_fast(sizeof(T), alignof(T)));
+    polymorphic_allocator<T>(this).construct(p, std::forward<Args>(args)...);
+
+    if constexpr (!std::is_trivially_destructible_v<T>)
+    {
+      record->prev = destructors;
+      record->destroy = [](void *object) noexcept {
+        static_cast<T *>(object)->~T();
+      };
+      record->object = p;
+      destructors = record;
+    }
+    return p;
+  }
+
+protected:
+  void *do_allocate(std::size_t bytes, std::size_t alignment) override
+  {
+    return allocate_fast(bytes, alignment);
+  }
+
+  void do_deallocate(void *p, std::size_t bytes,
+                     std::size_t alignment) override
+  {
+    deallocate_fast(p, bytes, alignment);
+  }
+
+  // The blocks are carved out of a single bump of the current region, one
+  // after the other.
+  void do_allocate_bulk(void **out, std::size_t count, std::size_t bytes,
+                        std::size_t alignment) override
+  {
+    if (count == 0)
+      return;
+    const auto stride =
+      detail::round_up(std::max<std::size_t>(bytes, 1), alignment);
+    if (stride > std::numeric_limits<std::size_t>::max() / count)
+      throw std::bad_alloc();
+
+    const auto p =
+      static_cast<std::byte *>(allocate_fast(stride * count, alignment));
+    for (std::size_t i = 0; i < count; ++i)
+      out[i] = p + i * stride;
+  }
+
+  void do_deallocate_bulk(void *const *, std::size_t, std::size_t,
+                          std::size_t) override
+  {
+    // Do nothing.
+  }
+
+  bool do_try_expand(void *p, std::size_t old_bytes,
+                     std::size_t new_bytes) noexcept override
+  {
+    return try_expand(p, old_bytes, new_bytes);
+  }
+
+  bool do_is_equal(const memory_resource &other) const noexcept override
+  {
+    return this == &other;
+  }
+
+private:
+  // Upstream memory resource from which we allocate regions.
+  memory_resource *upstream;
+
+  monotonic_options opts; ///< How regions grow.
+
+  std::byte *region_base_ptr = nullptr; ///< Current region.
+  std::byte *region_cur_ptr = nullptr; ///< Current free space in the region.
+  std::byte *region_end_ptr = nullptr; ///< End of the region.
+  std::byte *region_limit_ptr = nullptr; ///< End of the region's free space.
+  // Size of the next allocated region.
+  std::size_t next_region_size = detail::default_monotonic_initial_size;
+
+  // Whether we allocated the region ourselves. Only the first region may be
+  // unowned.
+  bool owns_region = false;
+
+  // Released regions kept for reuse, linked through their headers.
+  std::byte *retained_base_ptr = nullptr;
+  std::byte *retained_end_ptr = nullptr;
+  std::size_t retained_bytes = 0;
+
+  // Region kept by reset() while allocating from the initial buffer, which is
+  // taken up before any other once the buffer runs out.
+  std::byte *spare_base_ptr = nullptr;
+  std::size_t spare_size = 0;
+
+  // How to destroy an object made by create(), allocated right before it.
+  struct destructor_record
+  {
+    destructor_record *prev; ///< Object created before this one.
+    void (*destroy)(void *object) noexcept;
+    void *object;
+  };
+
+  destructor_record *destructors = nullptr; ///< Newest object to destroy.
+
+  // Destroys the objects created after `last`, newest first. Each record is
+  // unlinked before its object is destroyed, in case the destructor creates
+  // objects of its own.
+  void destroy_objects(destructor_record *last) noexcept
+  {
+    while (destructors != last)
+    {
+      const auto record = destructors;
+      destructors = record->prev;
+      record->destroy(record->object);
+    }
+  }
+
+  // Information about a region allocated by this monotonic buffer resource. The
+  // first bytes of an owned region contain the following structure, or its
+  // last bytes with `header_at_end`.
+  //
+  // This approach effectively creates a linked list of regions, connecting the
+  // last region to the previous one and so on.
+  struct owned_region_header
+  {
+    std::byte *prev_region_base_ptr;
+    std::byte *prev_region_cur_ptr;
+    std::byte *prev_region_end_ptr;
+    bool owns_prev_region;
+  };
+
+  // Takes `bytes` at `alignment` from the current region, or returns null if
+  // there isn't enough space left in it.
+  void *bump(std::size_t bytes, std::size_t alignment) noexcept
+  {
+    const auto space =
+      static_cast<std::size_t>(region_limit_ptr - region_cur_ptr);
+    const auto padding =
+      static_cast<std::size_t>(
+        -reinterpret_cast<std::uintptr_t>(region_cur_ptr)) &
+      (alignment - 1);
+
+    // Comparing `padding < space` rules out the case where there isn't a
+    // region at all, in which case both are zero.
+    if (padding < space && bytes <= space - padding)
+    {
+      const auto aligned_cur_ptr = region_cur_ptr + padding;
+      region_cur_ptr = aligned_cur_ptr + bytes;
+      detail::asan_unpoison(aligned_cur_ptr, bytes);
+      return aligned_cur_ptr;
+    }
+
+    return nullptr;
+  }
+
+  // Kept out of the fast path, so that allocate_fast stays small enough to be
+  // inlined.
+  void *allocate_from_new_region(std::size_t bytes, std::size_t alignment)
+  {
+    // We either don't have a region yet, or we need to allocate one.
+    // When the initial buffer (if any) is exhausted, it obtains additional
+    // buffers from an upstream memory resource supplied at construction.
+    // Each additional buffer is larger than the previous one, following a
+    // geometric progression.
+
+    // The next region needs to be able to fit its own header and the requested
+    // bytes. Padding is added so there's enough space for the requested bytes,
+    // when they're more aligned than the region's free space is guaranteed to
+    // be, otherwise aligned addresses may cause the memory resource to think
+    // the region is full, when in fact it has enough space but no good aligned
+    // address. At least one byte is reserved, as bump() never hands out the
+    // end of a region.
+    const auto free_space_alignment =
+      opts.header_at_end
+        ? region_alignment()
+        : std::min(region_alignment(), sizeof(owned_region_header) &
+                                         -sizeof(owned_region_header));
+    const auto padding =
+      alignment > free_space_alignment ? alignment - free_space_alignment : 0;
+    const auto required_size = detail::round_up(
+      sizeof(owned_region_header) + padding + std::max<std::size_t>(bytes, 1),
+      alignof(owned_region_header));
+
+    const bool is_huge = opts.huge_allocation_threshold != 0 &&
+                         bytes >= opts.huge_allocation_threshold;
+    if (is_huge && owns_region)
+      return allocate_dedicated_region(bytes, alignment, required_size);
+
+    // A huge allocation which can't be put behind the current region still
+    // gets a region of its own size, but the progression is kept as is.
+    const auto this_region_size = detail::round_up(
+      is_huge ? required_size : std::max(next_region_size, required_size),
+      alignof(owned_region_header));
+
+    auto obtained_size = this_region_size;
+    bool reused = false;
+    const auto next_region_storage =
+      obtain_region(required_size, obtained_size, reused);
+    if (next_region_storage)
+    {
+      push_region(static_cast<std::byte *>(next_region_storage),
+                  obtained_size);
+      if (!is_huge && !reused)
+        next_region_size = compute_next_grow(obtained_size);
+      assert(next_region_size > 0);
+
+      // We could just call allocate_fast recursively here, but we need to
+      // assert that the aligned address is good.
+      const auto aligned_cur_ptr = bump(bytes, alignment);
+      assert(aligned_cur_ptr);
+      return aligned_cur_ptr;
+    }
+
+    return nullptr;
+  }
+
+  // Allocates a region just for a huge allocation, and links it right behind
+  // the current region. That way, neither the free space left in the current
+  // region nor the size of the next regions are affected by it.
+  void *allocate_dedicated_region(std::size_t bytes, std::size_t alignment,
+                                  std::size_t required_size)
+  {
+    assert(owns_region && region_base_ptr);
+    auto size = required_size;
+    bool reused = false;
+    const auto storage = obtain_region(required_size, size, reused);
+    if (!storage)
+      return nullptr;
+
+    const auto base_ptr = static_cast<std::byte *>(storage);
+    auto cur_header = read_header(region_base_ptr, region_end_ptr);
+    write_header(base_ptr, base_ptr + size, cur_header);
+    cur_header.prev_region_base_ptr = base_ptr;
+    cur_header.prev_region_end_ptr = base_ptr + size;
+    cur_header.owns_prev_region = true;
+
+    void *p = base_ptr + front_offset();
+    auto space = size - sizeof(owned_region_header);
+    [[maybe_unused]] const auto aligned_p =
+      std::align(alignment, bytes, p, space);
+    assert(aligned_p);
+
+    cur_header.prev_region_cur_ptr = static_cast<std::byte *>(p) + bytes;
+    write_header(region_base_ptr, region_end_ptr, cur_header);
+    detail::asan_poison(base_ptr + front_offset(),
+                        size - sizeof(owned_region_header));
+    detail::asan_unpoison(p, bytes);
+    return p;
+  }
+
+  // Size of the region following one of `reg_size` bytes, according to the
+  // growth policy.
+  std::size_t compute_next_grow(std::size_t reg_size) const
+  {
+    const auto max_size = opts.max_region_size != 0
+                            ? opts.max_region_size
+                            : std::numeric_limits<std::size_t>::max();
+    const auto grown = static_cast<double>(reg_size) * opts.growth_factor;
+    if (grown >= static_cast<double>(max_size))
+      return max_size;
+    return std::max(reg_size, static_cast<std::size_t>(grown));
+  }
+
+  // Gets a region of at least `min_size` bytes. A retained region is used if
+  // there's one large enough, in which case `reused` is set and `size` gets
+  // its size. Otherwise, a region of `size` bytes is obtained from upstream.
+  void *obtain_region(std::size_t min_size, std::size_t &size, bool &reused)
+  {
+    if (spare_base_ptr && spare_size >= min_size)
+    {
+      size = std::exchange(spare_size, 0);
+      reused = true;
+      return std::exchange(spare_base_ptr, nullptr);
+    }
+
+    std::byte *prev_base_ptr = nullptr;
+    std::byte *prev_end_ptr = nullptr;
+    auto base_ptr = retained_base_ptr;
+    auto end_ptr = retained_end_ptr;
+    while (base_ptr)
+    {
+      const auto header = read_header(base_ptr, end_ptr);
+      const auto candidate_size =
+        static_cast<std::size_t>(end_ptr - base_ptr);
+      if (candidate_size >= min_size)
+      {
+        // Unlinks the region from the retained list.
+        if (prev_base_ptr)
+        {
+          auto prev_header = read_header(prev_base_ptr, prev_end_ptr);
+          prev_header.prev_region_base_ptr = header.prev_region_base_ptr;
+          prev_header.prev_region_end_ptr = header.prev_region_end_ptr;
+          write_header(prev_base_ptr, prev_end_ptr, prev_header);
+        }
+        else
+        {
+          retained_base_ptr = header.prev_region_base_ptr;
+          retained_end_ptr = header.prev_region_end_ptr;
+        }
+        retained_bytes -= candidate_size;
+        size = candidate_size;
+        reused = true;
+        return base_ptr;
+      }
+      prev_base_ptr = base_ptr;
+      prev_end_ptr = end_ptr;
+      base_ptr = header.prev_region_base_ptr;
+      end_ptr = header.prev_region_end_ptr;
+    }
+
+    reused = false;
+    return upstream->allocate(size, region_alignment());
+  }
+
+  // Gives a region we no longer use back to upstream, or keeps it for reuse
+  // if that doesn't exceed `max_retained_bytes`.
+  void discard_region(std::byte *base_ptr, std::size_t size)
+  {
+    assert(retained_bytes <= opts.max_retained_bytes);
+    detail::asan_unpoison(base_ptr, size);
+    if (size > opts.max_retained_bytes - retained_bytes)
+      return upstream->deallocate(base_ptr, size, region_alignment());
+
+    // Retained regions are linked through their headers just like the ones in
+    // use, so the most recently retained one is reused first.
+    write_header(base_ptr, base_ptr + size,
+                 {retained_base_ptr, nullptr, retained_end_ptr, true});
+    retained_base_ptr = base_ptr;
+    retained_end_ptr = base_ptr + size;
+    retained_bytes += size;
+  }
+
+  // Keeps the owned region of `size` bytes at `base_ptr`, which is no longer
+  // in use, as the spare region.
+  void set_aside_region(std::byte *base_ptr, std::size_t size) noexcept
+  {
+    assert(!spare_base_ptr);
+    detail::asan_poison(base_ptr + front_offset(),
+                        size - sizeof(owned_region_header));
+    spare_base_ptr = base_ptr;
+    spare_size = size;
+  }
+
+  void discard_spare_region()
+  {
+    if (spare_base_ptr)
+      discard_region(std::exchange(spare_base_ptr, nullptr),
+                     std::exchange(spare_size, 0));
+  }
+
+  // Gives the current region back to upstream (or retains it), and makes the
+  // previous one current.
+  void pop_region()
+  {
+    assert(owns_region && region_base_ptr);
+    const auto header = read_header(region_base_ptr, region_end_ptr);
+    discard_region(region_base_ptr, region_size());
+    make_prev_region_current(header);
+  }
+
+  // Poisons the current region's free space, which is unpoisoned as bump()
+  // hands it out, after allocations in it were undone.
+  void poison_free_space() noexcept
+  {
+    detail::asan_poison(region_cur_ptr,
+                        static_cast<std::size_t>(region_limit_ptr -
+                                                 region_cur_ptr));
+  }
+
+  // Makes the previous region current, without deallocating the current one.
+  void skip_region() noexcept
+  {
+    assert(owns_region && region_base_ptr);
+    make_prev_region_current(
+      read_header(region_base_ptr, region_end_ptr));
+  }
+
+  // Makes the region described by `header` current. Its cursor is left to
+  // the caller.
+  void make_prev_region_current(const owned_region_header &header) noexcept
+  {
+    region_base_ptr = header.prev_region_base_ptr;
+    region_end_ptr = header.prev_region_end_ptr;
+    owns_region = header.owns_prev_region;
+    region_limit_ptr =
+      owns_region ? region_end_ptr - tail_offset() : region_end_ptr;
+  }
+
+  // Makes an owned region of `size` bytes at `base_ptr` current, linking it
+  // to the current one.
+  void push_region(std::byte *base_ptr, std::size_t size) noexcept
+  {
+    write_header(base_ptr, base_ptr + size,
+                 {region_base_ptr, region_cur_ptr, region_end_ptr,
+                  owns_region});
+    region_base_ptr = base_ptr;
+    region_cur_ptr = base_ptr + front_offset();
+    region_end_ptr = base_ptr + size;
+    region_limit_ptr = region_end_ptr - tail_offset();
+    owns_region = true;
+    poison_free_space();
+  }
+
+  std::size_t region_alignment() const noexcept
+  {
+    return opts.region_alignment != 0 ? opts.region_alignment
+                                      : alignof(std::max_align_t);
+  }
+
+  // Bytes the header takes at the start and at the end of an owned region.
+  std::size_t front_offset() const noexcept
+  {
+    return opts.header_at_end ? 0 : sizeof(owned_region_header);
+  }
+
+  std::size_t tail_offset() const noexcept
+  {
+    return opts.header_at_end ? sizeof(owned_region_header) : 0;
+  }
+
+  std::byte *header_ptr(std::byte *base_ptr, std::byte *end_ptr) const noexcept
+  {
+    return opts.header_at_end ? end_ptr - sizeof(owned_region_header)
+                              : base_ptr;
+  }
+
+  owned_region_header read_header(std::byte *base_ptr,
+                                  std::byte *end_ptr) const noexcept
+  {
+    owned_region_header header;
+    std::memcpy(&header, header_ptr(base_ptr, end_ptr), sizeof(header));
+    return header;
+  }
+
+  void write_header(std::byte *base_ptr, std::byte *end_ptr,
+                    const owned_region_header &header) noexcept
+  {
+    std::memcpy(header_ptr(base_ptr, end_ptr), &header, sizeof(header));
+  }
+
+  std::size_t region_size() const
+  {
+    return static_cast<std::size_t>(region_end_ptr - region_base_ptr);
+  }
+
+  // Whether `p` of `bytes` ends where the free space of the current region
+  // starts, which only the most recent allocation from it can do.
+  bool is_last_allocation(void *p, std::size_t bytes) const noexcept
+  {
+    return p && region_cur_ptr &&
+           static_cast<std::byte *>(p) + bytes == region_cur_ptr;
+  }
+};
+
+namespace detail {
+
+// Storage of an inline_buffer_resource, in a base class of its own, so that
+// it exists before the monotonic_buffer_resource base is given it.
+template <std::size_t Size, std::size_t Align>
+struct inline_storage
+{
+  alignas(Align) std::byte buffer[Size];
+};
+
+} // namespace detail
+
+// A monotonic_buffer_resource whose initial buffer is `N` bytes of its own,
+// so that when it's declared in a scope whose allocations fit in them, it
+// never calls upstream, and only falls back to it when they don't. release()
+// and rewind() hand the buffer out again.
+template <std::size_t N, std::size_t Align = alignof(std::max_align_t)>
+class inline_buffer_resource : private detail::inline_storage<N, Align>,
+                               public monotonic_buffer_resource
+{
+  static_assert(N > 0, "the buffer can't be empty");
+
+public:
+  static constexpr std::size_t buffer_size = N;
+  static constexpr std::size_t buffer_alignment = Align;
+
+  inline_buffer_resource()
+    : inline_buffer_resource(get_default_resource())
+  {}
+
+  explicit inline_buffer_resource(memory_resource *upstream)
+    : monotonic_buffer_resource(this->buffer, N, upstream)
+  {}
+
+  // Regions obtained after the buffer runs out follow `opts`.
+  inline_buffer_resource(const monotonic_options &opts,
+                         memory_resource *upstream)
+    : monotonic_buffer_resource(this->buffer, N, opts, upstream)
+  {}
+
+  inline_buffer_resource(const inline_buffer_resource &) = delete;
+  inline_buffer_resource &operator=(const inline_buffer_resource &) = delete;
+
+  // Whether `p` points into the buffer, rather than to memory from upstream.
+  bool is_inline(const void *p) const noexcept
+  {
+    const auto q = static_cast<const std::byte *>(p);
+    return !std::less<const std::byte *>()(q, this->buffer) &&
+           std::less<const std::byte *>()(q, this->buffer + N);
+  }
+};
+
+// A monotonic resource that many threads can allocate from at once, without
+// locking. Allocations bump a cursor in the current region with an atomic
+// fetch_add, and when a region runs out, a new one is obtained from upstream
+// under a lock, so that the threads which ran out along with the one that
+// obtains it allocate from it too, rather than each obtaining a region of its
+// own. Like monotonic_buffer_resource,
+// deallocation does nothing, and memory is given back all at once by
+// release() or destruction, which must not run concurrently with
+// allocations.
+//
+// Sizes are rounded up to `alignof(std::max_align_t)`, so that the cursor
+// stays aligned for any fundamental alignment. Larger alignments take a
+// compare-and-swap loop instead. The upstream resource has to be thread-safe.
+class concurrent_monotonic_resource : public memory_resource
+{
+public:
+  explicit concurrent_monotonic_resource(memory_resource *mr) : upstream(mr)
+  {}
+
+  concurrent_monotonic_resource(std::size_t initial_size, memory_resource *mr)
+    : upstream(mr), next_region_size(initial_size)
+  {
+    assert(initial_size > 0);
+  }
+
+  // The first region is taken from `buffer`, which isn't deallocated. It must
+  // be at least large enough for a region header.
+  concurrent_monotonic_resource(void *buffer, std::size_t buffer_size,
+                                memory_resource *mr)
+    : upstream(mr), next_region_size(buffer_size * 2)
+  {
+    const auto aligned = std::align(granularity, header_size, buffer,
+                                    buffer_size);
+    assert(aligned && buffer_size > header_size);
+    initial_region = install(aligned, buffer_size, header_size, false);
+    current.store(initial_region, std::memory_order_relaxed);
+  }
+
+  concurrent_monotonic_resource()
+    : concurrent_monotonic_resource(get_default_resource())
+  {}
+
+  explicit concurrent_monotonic_resource(std::size_t initial_size)
+    : concurrent_monotonic_resource(initial_size, get_default_resource())
+  {}
+
+  concurrent_monotonic_resource(void *buffer, std::size_t buffer_size)
+    : concurrent_monotonic_resource(buffer, buffer_size,
+                                    get_default_resource())
+  {}
+
+  concurrent_monotonic_resource(const concurrent_monotonic_resource &) =
+    delete;
+  concurrent_monotonic_resource &
+  operator=(const concurrent_monotonic_resource &) = delete;
+
+  virtual ~concurrent_monotonic_resource() override { release(); }
+
+  // Gives every region back to upstream, and starts over from the initial
+  // buffer, if any. No other thread may be allocating meanwhile.
+  void release()
+  {
+    auto r = regions.load(std::memory_order_acquire);
+    while (r)
+    {
+      const auto prev = r->prev;
+      if (r->owned)
+        upstream->deallocate(r, r->size, granularity);
+      r = prev;
+    }
+
+    if (initial_region)
+    {
+      initial_region->prev = nullptr;
+      initial_region->cur.store(header_size, std::memory_order_relaxed);
+    }
+    regions.store(initial_region, std::memory_order_release);
+    current.store(initial_region, std::memory_order_release);
+  }
+
+  memory_resource *upstream_resource() const { return upstream; }
+
+  // Allocates like `allocate`, except it isn't virtual, so it can be inlined
+  // when the resource type is known.
+  //
+  // `alignment` must be a power of two.
+  [[nodiscard]] void *
+  allocate_fast(std::size_t bytes,
+                std::size_t alignment = alignof(std::max_align_t))
+  {
+    assert(alignment > 0 && (alignment & (alignment - 1)) == 0);
+    const auto r = current.load(std::memory_order_acquire);
+    if (r && alignment <= granularity)
+    {
+      const auto size = rounded_size(bytes);
+      const auto offset = r->cur.fetch_add(size, std::memory_order_relaxed);
+      if (offset <= r->size && size <= r->size - offset)
+        return reinterpret_cast<std::byte *>(r) + offset;
+    }
+    return allocate_slow(bytes, alignment);
+  }
+
+  void deallocate_fast(void *, std::size_t, std::size_t) noexcept
+  {
+    // Do nothing.
+  }
+
+protected:
+  void *do_allocate(std::size_t bytes, std::size_t alignment) override
+  {
+    return allocate_fast(bytes, alignment);
+  }
+
+  void do_deallocate(void *p, std::size_t bytes,
+                     std::size_t alignment) override
+  {
+    deallocate_fast(p, bytes, alignment);
+  }
+
+  // The blocks are carved out of a single fetch_add on the cursor, one after
+  // the other.
+  void do_allocate_bulk(void **out, std::size_t count, std::size_t bytes,
+                        std::size_t alignment) override
+  {
+    if (count == 0)
+      return;
+    const auto stride =
+      detail::round_up(std::max<std::size_t>(bytes, 1), alignment);
+    if (stride > std::numeric_limits<std::size_t>::max() / count)
+      throw std::bad_alloc();
+
+    const auto p =
+      static_cast<std::byte *>(allocate_fast(stride * count, alignment));
+    for (std::size_t i = 0; i < count; ++i)
+      out[i] = p + i * stride;
+  }
+
+  void do_deallocate_bulk(void *const *, std::size_t, std::size_t,
+                          std::size_t) override
+  {
+    // Do nothing.
+  }
+
+  bool do_is_equal(const memory_resource &other) const noexcept override
+  {
+    return this == &other;
+  }
+
+private:
+  static constexpr std::size_t granularity = alignof(std::max_align_t);
+
+  // The first bytes of every region. Regions are linked from the newest one,
+  // so they can all be deallocated by release().
+  struct region_header
+  {
+    region_header *prev;
+    std::size_t size; ///< Size of the region, including this header.
+    std::atomic<std::size_t> cur; ///< Offset of the free space.
+    bool owned; ///< Whether the region came from upstream.
+  };
+
+  static constexpr std::size_t header_size =
+    detail::round_up(sizeof(region_header), granularity);
+
+  static std::size_t rounded_size(std::size_t bytes) noexcept
+  {
+    return detail::round_up(std::max<std::size_t>(bytes, 1), granularity);
+  }
+
+  // Takes space at an alignment larger than the cursor's from `r`, or
+  // returns null if it doesn't fit.
+  static void *bump_aligned(region_header *r, std::size_t bytes,
+                            std::size_t alignment) noexcept
+  {
+    const auto base = reinterpret_cast<std::uintptr_t>(r);
+    const auto size = rounded_size(bytes);
+    auto offset = r->cur.load(std::memory_order_relaxed);
+    while (offset <= r->size)
+    {
+      const auto aligned = detail::round_up(base + offset, alignment) - base;
+      if (aligned > r->size || size > r->size - aligned)
+        return nullptr;
+      if (r->cur.compare_exchange_weak(offset, aligned + size,
+                                       std::memory_order_relaxed))
+        return reinterpret_cast<std::byte *>(r) + aligned;
+    }
+    return nullptr;
+  }
+
+  // Initializes a region at `storage`, whose first `used` bytes are taken,
+  // and links it in the list of regions.
+  region_header *install(void *storage, std::size_t size, std::size_t used,
+                         bool owned) noexcept
+  {
+    auto r = new (storage) region_header;
+    r->size = size;
+    r->cur.store(used, std::memory_order_relaxed);
+    r->owned = owned;
+    r->prev = regions.load(std::memory_order_relaxed);
+    while (!regions.compare_exchange_weak(r->prev, r,
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed))
+    {
+    }
+    return r;
+  }
+
+  // Kept out of the fast path, so that allocate_fast stays small enough to be
+  // inlined.
+  void *allocate_slow(std::size_t bytes, std::size_t alignment)
+  {
+    const auto extra = alignment > granularity ? alignment - granularity : 0;
+    const auto required_size = header_size + extra + rounded_size(bytes);
+    alignment = std::max(alignment, granularity);
+
+    auto r = current.load(std::memory_order_acquire);
+    if (r)
+    {
+      if (const auto p = bump_aligned(r, bytes, alignment))
+        return p;
+    }
+
+    // Allocations larger than the next region get one of their own, which
+    // doesn't replace the current region.
+    if (required_size > next_region_size.load(std::memory_order_relaxed))
+      return new_region(required_size, bytes, alignment).second;
+
+    std::lock_guard<std::mutex> lock(region_mutex);
+
+    // Another thread might have installed a region after `r` ran out.
+    const auto latest = current.load(std::memory_order_acquire);
+    if (latest != r && latest)
+    {
+      if (const auto p = bump_aligned(latest, bytes, alignment))
+        return p;
+    }
+
+    const auto region_size = next_region_size.load(std::memory_order_relaxed);
+    const auto allocated =
+      new_region(std::max(required_size, region_size), bytes, alignment);
+    current.store(allocated.first, std::memory_order_release);
+    next_region_size.store(region_size * 2, std::memory_order_relaxed);
+    return allocated.second;
+  }
+
+  // Obtains a region of `size` bytes from upstream, links it in the list of
+  // regions, and takes `bytes` at `alignment` from it. Returns the region and
+  // the allocation.
+  std::pair<region_header *, void *>
+  new_region(std::size_t size, std::size_t bytes, std::size_t alignment)
+  {
+    const auto storage = upstream->allocate(size, granularity);
+    const auto base = reinterpret_cast<std::uintptr_t>(storage);
+    const auto offset =
+      detail::round_up(base + header_size, alignment) - base;
+    return {install(storage, size, offset + rounded_size(bytes), true),
+            static_cast<std::byte *>(storage) + offset};
+  }
+
+  // Upstream memory resource from which we allocate regions.
+  memory_resource *upstream;
+
+  std::atomic<region_header *> current{nullptr}; ///< Region bumped into.
+  std::atomic<region_header *> regions{nullptr}; ///< Newest region.
+  region_header *initial_region = nullptr; ///< Region in the initial buffer.
+
+  // Held while obtaining a region to replace the current one.
+  std::mutex region_mutex;
+
+  // Size of the next allocated region. It's only changed with `region_mutex`
+  // held.
+  std::atomic<std::size_t> next_region_size{
+    detail::default_monotonic_initial_size};
+};
+
+// Usage statistics of a statistics_resource.
+struct resource_statistics
+{
+  static constexpr std::size_t size_classes =
+    std::numeric_limits<std::size_t>::digits + 1;
+  static constexpr std::size_t alignment_classes =
+    std::numeric_limits<std::size_t>::digits;
+
+  std::size_t allocations = 0; ///< Number of allocations.
+  std::size_t deallocations = 0; ///< Number of deallocations.
+  std::size_t bytes_allocated = 0; ///< Total bytes ever allocated.
+  std::size_t bytes_deallocated = 0; ///< Total bytes ever deallocated.
+  std::size_t live_bytes = 0; ///< Bytes allocated but not deallocated yet.
+
+  // Highest `live_bytes` seen so far. It's approximate: live bytes are
+  // gathered from threads in batches so that they don't contend, so a peak
+  // shorter than a batch in each thread may go unnoticed.
+  std::size_t peak_bytes = 0;
+
+  // `size_histogram[i]` counts allocations of more than 2^(i-1) and at most
+  // 2^i bytes, with allocations of zero bytes counted in the first class.
+  std::array<std::size_t, size_classes> size_histogram{};
+
+  // `alignment_histogram[i]` counts allocations aligned to 2^i.
+  std::array<std::size_t, alignment_classes> alignment_histogram{};
+};
+
+// Keeps usage statistics about allocations forwarded to an upstream memory
+// resource.
+//
+// Every thread updates counters of its own, which are only read (with relaxed
+// ordering) when statistics() gathers them, so keeping statistics costs about
+// the same as incrementing a few integers.
+class statistics_resource : public memory_resource
+{
+public:
+  explicit statistics_resource(memory_resource *upstream) : upstream(upstream)
+  {
+    assert(upstream);
+  }
+
+  statistics_resource() : statistics_resource(get_default_resource()) {}
+
+  statistics_resource(const statistics_resource &) = delete;
+  statistics_resource &operator=(const statistics_resource &) = delete;
+
+  // Gathers the statistics of all threads. It may run concurrently with
+  // allocations, in which case they may or may not be accounted for.
+  resource_statistics statistics() const
+  {
+    resource_statistics stats;
+    counters.for_each([&stats](thread_counters &c) {
+      stats.allocations += c.allocations.load(std::memory_order_relaxed);
+      stats.deallocations += c.deallocations.load(std::memory_order_relaxed);
+      stats.bytes_allocated +=
+        c.bytes_allocated.load(std::memory_order_relaxed);
+      stats.bytes_deallocated +=
+        c.bytes_deallocated.load(std::memory_order_relaxed);
+      for (std::size_t i = 0; i < stats.size_histogram.size(); ++i)
+        stats.size_histogram[i] +=
+          c.size_histogram[i].load(std::memory_order_relaxed);
+      for (std::size_t i = 0; i < stats.alignment_histogram.size(); ++i)
+        stats.alignment_histogram[i] +=
+          c.alignment_histogram[i].load(std::memory_order_relaxed);
+    });
+
+    // Deallocations may be seen without their allocations when they happen
+    // in different threads.
+    if (stats.bytes_allocated > stats.bytes_deallocated)
+      stats.live_bytes = stats.bytes_allocated - stats.bytes_deallocated;
+    stats.peak_bytes = std::max(
+      stats.live_bytes, static_cast<std::size_t>(std::max<std::ptrdiff_t>(
+                          peak_bytes.load(std::memory_order_relaxed), 0)));
+    return stats;
+  }
+
+  memory_resource *upstream_resource() const { return upstream; }
+
+protected:
+  void *do_allocate(std::size_t bytes, std::size_t alignment) override
+  {
+    const auto p = upstream->allocate(bytes, alignment);
+
+    auto &c = local_counters();
+    bump(c.allocations, 1);
+    bump(c.bytes_allocated, bytes);
+    bump(c.size_histogram[detail::ceil_log2(bytes)], 1);
+    bump(c.alignment_histogram[std::min(detail::ceil_log2(alignment),
+                                        c.alignment_histogram.size() - 1)],
+         1);
+    account(c, static_cast<std::ptrdiff_t>(bytes));
+    return p;
+  }
+
+  void do_deallocate(void *p, std::size_t bytes,
+                     std::size_t alignment) override
+  {
+    upstream->deallocate(p, bytes, alignment);
+
+    auto &c = local_counters();
+    bump(c.deallocations, 1);
+    bump(c.bytes_deallocated, bytes);
+    account(c, -static_cast<std::ptrdiff_t>(bytes));
+  }
+
+  bool do_is_equal(const memory_resource &other) const noexcept override
+  {
+    return this == &other;
+  }
+
+private:
+  using counter = std::atomic<std::size_t>;
+
+  // Counters are only written by their thread, and atomic just so they can be
+  // read from other threads.
+  struct thread_counters final : detail::listed_thread_cache
+  {
+    counter allocations{0};
+    counter deallocations{0};
+    counter bytes_allocated{0};
+    counter bytes_deallocated{0};
+    std::array<counter, resource_statistics::size_classes> size_histogram{};
+    std::array<counter, resource_statistics::alignment_classes>
+      alignment_histogram{};
+
+    // Live bytes not yet added to `live_bytes`.
+    std::ptrdiff_t pending_live_bytes = 0;
+  };
+
+  // Live bytes are gathered from threads once they change by this much.
+  static constexpr std::ptrdiff_t live_bytes_batch = 64 * 1024;
+
+  static void bump(counter &c, std::size_t n) noexcept
+  {
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  void account(thread_counters &c, std::ptrdiff_t delta) noexcept
+  {
+    c.pending_live_bytes += delta;
+    if (c.pending_live_bytes < live_bytes_batch &&
+        c.pending_live_bytes > -live_bytes_batch)
+      return;
+
+    const auto live =
+      live_bytes.fetch_add(c.pending_live_bytes, std::memory_order_relaxed) +
+      c.pending_live_bytes;
+    c.pending_live_bytes = 0;
+
+    auto peak = peak_bytes.load(std::memory_order_relaxed);
+    while (live > peak &&
+           !peak_bytes.compare_exchange_weak(peak, live,
+                                             std::memory_order_relaxed))
+    {
+    }
+  }
+
+  thread_counters &local_counters()
+  {
+    return counters.local([] { return std::make_unique<thread_counters>(); });
+  }
+
+  // Upstream memory resource to which we forward allocations.
+  memory_resource *upstream;
+
+  std::atomic<std::ptrdiff_t> live_bytes{0}; ///< Sum of batched live bytes.
+  std::atomic<std::ptrdiff_t> peak_bytes{0}; ///< Highest `live_bytes`.
+  detail::thread_cache_list<thread_counters> counters;
+};
+
+struct bounded_options
+{
+  // Most bytes that may be allocated at a time.
+  std::size_t limit = std::numeric_limits<std::size_t>::max();
+
+  // Bytes of the budget a thread reserves at once, so that it only touches
+  // the shared count once every so many bytes. A thread holds up to twice as
+  // many reserved bytes it hasn't allocated, which no other thread can use.
+  // Zero means a 256th of the limit, between 4 KiB and 1 MiB.
+  std::size_t reservation_bytes = 0;
+
+  // Called with `pressure_context` when an allocation of `bytes` would
+  // exceed the limit. If it returns true, such as after it freed memory or
+  // raised the limit, the allocation is tried again; otherwise, or if
+  // there's no callback, the allocation throws std::bad_alloc.
+  bool (*on_pressure)(void *context, std::size_t bytes) = nullptr;
+  void *pressure_context = nullptr;
+};
+
+// Forwards allocations to an upstream memory resource, as long as the bytes
+// allocated through it stay within a limit.
+//
+// Every thread reserves bytes of the budget in batches, and allocates and
+// deallocates against its own reservation, so the shared count is updated
+// once every few allocations, rather than on each one. Reservations count
+// against the limit, so allocated bytes never exceed it, though a request
+// may fail while other threads hold unused reservations.
+class bounded_resource : public memory_resource
+{
+public:
+  bounded_resource(const bounded_options &opts, memory_resource *upstream)
+    : upstream(upstream)
+    , opts(opts)
+    , max_bytes(opts.limit)
+    , batch(opts.reservation_bytes != 0
+              ? opts.reservation_bytes
+              : std::clamp<std::size_t>(opts.limit / 256, 4096,
+                                        std::size_t(1) << 20))
+  {
+    assert(upstream);
+  }
+
+  bounded_resource(std::size_t limit, memory_resource *upstream)
+    : bounded_resource(limit_options(limit), upstream)
+  {}
+
+  explicit bounded_resource(std::size_t limit)
+    : bounded_resource(limit, get_default_resource())
+  {}
+
+  bounded_resource(const bounded_resource &) = delete;
+  bounded_resource &operator=(const bounded_resource &) = delete;
+
+  memory_resource *upstream_resource() const { return upstream; }
+  bounded_options options() const { return opts; }
+
+  std::size_t limit() const noexcept
+  {
+    return max_bytes.load(std::memory_order_relaxed);
+  }
+
+  // Lowering the limit below what's reserved makes allocations fail until
+  // enough is deallocated.
+  void set_limit(std::size_t limit) noexcept
+  {
+    max_bytes.store(limit, std::memory_order_relaxed);
+  }
+
+  // Bytes of the budget taken, by allocations and threads' reservations.
+  std::size_t reserved_bytes() const noexcept
+  {
+    return reserved.load(std::memory_order_relaxed);
+  }
+
+  // Bytes allocated and not yet deallocated. It gathers every thread's
+  // reservation, so it's approximate while others allocate.
+  std::size_t live_bytes() const
+  {
+    std::size_t unused = 0;
+    credits.for_each([&unused](thread_credit &c) {
+      unused += c.credit.load(std::memory_order_relaxed);
+    });
+    const auto total = reserved_bytes();
+    return total > unused ? total - unused : 0;
+  }
+
+  // Number of allocations that failed because of the limit.
+  std::size_t rejections() const noexcept
+  {
+    return rejected.load(std::memory_order_relaxed);
+  }
+
+  // Non-virtual versions of `allocate` and `deallocate`, so they can be
+  // inlined when the resource type is known.
+  [[nodiscard]] void *allocate_fast(std::size_t bytes, std::size_t alignment)
+  {
+    auto &c = local_credit();
+    auto credit = c.credit.load(std::memory_order_relaxed);
+    while (credit < bytes)
+    {
+      // The credit is read again, as the pressure callback may deallocate.
+      const auto amount = reserve(bytes - credit);
+      credit = c.credit.load(std::memory_order_relaxed) + amount;
+      c.credit.store(credit, std::memory_order_relaxed);
+    }
+
+    // If upstream throws, the reservation stays with the thread.
+    const auto p = upstream->allocate(bytes, alignment);
+    c.credit.store(credit - bytes, std::memory_order_relaxed);
+    return p;
+  }
+
+  void deallocate_fast(void *p, std::size_t bytes, std::size_t alignment)
+  {
+    upstream->deallocate(p, bytes, alignment);
+
+    auto &c = local_credit();
+    auto credit = c.credit.load(std::memory_order_relaxed) + bytes;
+    if (credit > 2 * batch)
+    {
+      reserved.fetch_sub(credit - batch, std::memory_order_relaxed);
+      credit = batch;
+    }
+    c.credit.store(credit, std::memory_order_relaxed);
+  }
+
+protected:
+  void *do_allocate(std::size_t bytes, std::size_t alignment) override
+  {
+    return allocate_fast(bytes, alignment);
+  }
+
+  void do_deallocate(void *p, std::size_t bytes,
+                     std::size_t alignment) override
+  {
+    deallocate_fast(p, bytes, alignment);
+  }
+
+  bool do_is_equal(const memory_resource &other) const noexcept override
+  {
+    return this == &other;
+  }
+
+private:
+  // Bytes of the budget a thread reserved and hasn't allocated. Only its
+  // thread writes it.
+  struct thread_credit final : detail::listed_thread_cache
+  {
+    explicit thread_credit(bounded_resource *owner) : owner(owner) {}
+
+    // Gives the reservation back when the thread exits.
+    void flush() noexcept override
+    {
+      owner->reserved.fetch_sub(credit.load(std::memory_order_relaxed),
+                                std::memory_order_relaxed);
+      credit.store(0, std::memory_order_relaxed);
+    }
+
+    bounded_resource *owner;
+    std::atomic<std::size_t> credit{0};
+  };
+
+  static bounded_options limit_options(std::size_t limit) noexcept
+  {
+    bounded_options opts;
+    opts.limit = limit;
+    return opts;
+  }
+
+  thread_credit &local_credit()
+  {
+    return credits.local(
+      [this] { return std::make_unique<thread_credit>(this); });
+  }
+
+  // Takes at least `need` bytes of the budget, and a whole batch if it's
+  // there, and returns how many were taken. Throws std::bad_alloc if they
+  // aren't there, and the pressure callback doesn't make room.
+  std::size_t reserve(std::size_t need)
+  {
+    for (;;)
     {
-      assert(region_cur_ptr);
+      const auto max = max_bytes.load(std::memory_order_relaxed);
+      auto cur = reserved.load(std::memory_order_relaxed);
+      while (cur <= max && max - cur >= need)
+      {
+        const auto amount = std::min(std::max(need, batch), max - cur);
+        if (reserved.compare_exchange_weak(cur, cur + amount,
+                                           std::memory_order_relaxed))
+          return amount;
+      }
 
-      auto space = static_cast<std::size_t>(region_end_ptr - region_cur_ptr);
-      void *aligned_cur_ptr = region_cur_ptr;
-      if (std::align(alignment, bytes, aligned_cur_ptr, space))
+      if (!opts.on_pressure || !opts.on_pressure(opts.pressure_context, need))
       {
-        region_cur_ptr = static_cast<std::byte *>(aligned_cur_ptr) + bytes;
-        return aligned_cur_ptr;
+        rejected.fetch_add(1, std::memory_order_relaxed);
+        throw std::bad_alloc();
       }
     }
+  }
 
-    // We either don't have a region yet, or we need to allocate one.
-    // When the initial buffer (if any) is exhausted, it obtains additional
-    // buffers from an upstream memory resource supplied at construction.
-    // Each additional buffer is larger than the previous one, following a
-    // geometric progression.
+  // Upstream memory resource to which we forward allocations.
+  memory_resource *upstream;
 
-    // The next region needs to be able to fit its own header and the requested
-    // bytes. Alignment is added so there's enough space for the requested
-    // bytes, otherwise aligned addresses may cause the memory resource to think
-    // the region is full, when in fact it has enough space but no good aligned
-    // address.
-    const auto required_size =
-      ((sizeof(owned_region_header) + alignment - 1) / alignment) * alignment +
-      bytes;
-    if (next_region_size < required_size)
-      next_region_size = required_size;
-
-    const auto next_region_storage = upstream->allocate(next_region_size);
-    if (next_region_storage)
+  bounded_options opts;
+  std::atomic<std::size_t> max_bytes; ///< Current limit.
+  std::size_t batch; ///< Bytes reserved at once.
+  std::atomic<std::size_t> reserved{0}; ///< Bytes of the budget taken.
+  std::atomic<std::size_t> rejected{0}; ///< Allocations over the limit.
+  detail::thread_cache_list<thread_credit> credits;
+};
+
+struct debug_options
+{
+  // One in this many allocations gets canaries, which are checked when it's
+  // deallocated, and is filled when it's allocated and deallocated. One
+  // checks every allocation. The size and alignment of every deallocation
+  // are checked regardless, as that only takes a header.
+  std::size_t sample_interval = 1;
+
+  // Bytes of canaries on each side of a checked allocation.
+  std::size_t red_zone_bytes = 16;
+
+  // Whether checked allocations are filled with `debug_resource::fresh_byte`
+  // and, as they're deallocated, with `debug_resource::freed_byte`, so that
+  // reading memory that's uninitialized or no longer allocated stands out.
+  bool fill_memory = true;
+
+  // Called with `error_context`, a description of an error and the address
+  // of the allocation it's about. Without a callback, they're printed to
+  // stderr and the program aborts. If it returns, the deallocation goes on
+  // with the size and alignment the memory was allocated with, unless the
+  // header was overwritten, in which case the memory is leaked.
+  void (*on_error)(void *context, const char *message, const void *p) = nullptr;
+  void *error_context = nullptr;
+};
+
+namespace detail {
+// Allocations a thread makes through debug resources before the next one is
+// checked. It's shared by all of them, so sampling costs a decrement.
+inline thread_local std::size_t debug_sample_countdown = 0;
+} // namespace detail
+
+// Forwards allocations to an upstream memory resource, and catches misuses
+// of them: deallocations with a size or alignment other than the
+// allocation's, which corrupt pools, of memory that wasn't allocated by it,
+// or twice, and writes past either end of an allocation.
+//
+// Every allocation is preceded by a header that records its size and
+// alignment. Sampled allocations are also surrounded by canaries, which are
+// checked as they're deallocated. With AddressSanitizer, the headers and
+// canaries are poisoned as well, so overruns are reported as they happen,
+// and so is memory the pool and monotonic resources hold but haven't handed
+// out (see `FEROLDI_PMR_ASAN_POISONING`).
+class debug_resource : public memory_resource
+{
+public:
+  static constexpr unsigned char canary_byte = 0xfd;
+  static constexpr unsigned char fresh_byte = 0xcd;
+  static constexpr unsigned char freed_byte = 0xdd;
+
+  debug_resource(const debug_options &opts, memory_resource *upstream)
+    : upstream(upstream), opts(opts)
+  {
+    assert(upstream);
+    this->opts.sample_interval = std::max<std::size_t>(opts.sample_interval, 1);
+  }
+
+  explicit debug_resource(memory_resource *upstream)
+    : debug_resource(debug_options(), upstream)
+  {}
+
+  debug_resource() : debug_resource(get_default_resource()) {}
+
+  debug_resource(const debug_resource &) = delete;
+  debug_resource &operator=(const debug_resource &) = delete;
+
+  memory_resource *upstream_resource() const { return upstream; }
+  debug_options options() const { return opts; }
+
+  // Number of errors found so far.
+  std::size_t errors() const noexcept
+  {
+    return error_count.load(std::memory_order_relaxed);
+  }
+
+  // Non-virtual versions of `allocate` and `deallocate`, so they can be
+  // inlined when the resource type is known.
+  [[nodiscard]] void *allocate_fast(std::size_t bytes, std::size_t alignment)
+  {
+    const auto red_zone = sample() ? opts.red_zone_bytes : 0;
+    const auto offset = header_offset(red_zone, alignment);
+    if (bytes > std::numeric_limits<std::size_t>::max() - offset - red_zone)
+      throw std::bad_alloc();
+
+    const auto base = static_cast<std::byte *>(upstream->allocate(
+      offset + bytes + red_zone, std::max(alignment, alignof(header))));
+    const auto p = base + offset;
+    const header h{bytes, alignment, red_zone, live_magic ^ address_of(p)};
+    std::memcpy(p - sizeof(header), &h, sizeof(header));
+    if (red_zone != 0)
     {
-      auto next_region_header = new (next_region_storage) owned_region_header;
-      next_region_header->prev_region_base_ptr = region_base_ptr;
-      next_region_header->prev_region_end_ptr = region_end_ptr;
-      next_region_header->owns_prev_region = owns_region;
-
-      const auto next_region_base_ptr =
-        static_cast<std::byte *>(next_region_storage);
-      region_base_ptr = next_region_base_ptr;
-      region_cur_ptr = next_region_base_ptr + sizeof(owned_region_header);
-      region_end_ptr = next_region_base_ptr + next_region_size;
-      [[maybe_unused]] const auto old_next_region_size = next_region_size;
-      next_region_size = compute_next_grow(next_region_size);
-      assert(next_region_size >= old_next_region_size);
-      owns_region = true;
-
-      // We could just call do_allocate recursively here, but we need to assert
-      // that the aligned address is good.
-      auto space = static_cast<std::size_t>(region_end_ptr - region_cur_ptr);
-      void *cur_ptr = region_cur_ptr;
-      const auto aligned_cur_ptr = std::align(alignment, bytes, cur_ptr, space);
-      assert(aligned_cur_ptr);
-      region_cur_ptr = static_cast<std::byte *>(aligned_cur_ptr) + bytes;
-      return aligned_cur_ptr;
+      std::memset(p - sizeof(header) - red_zone, canary_byte, red_zone);
+      std::memset(p + bytes, canary_byte, red_zone);
+      if (opts.fill_memory)
+        std::memset(p, fresh_byte, bytes);
     }
 
-    return nullptr;
+    detail::asan_poison(base, offset);
+    detail::asan_poison(p + bytes, red_zone);
+    return p;
   }
 
-  void do_deallocate(void *, std::size_t, std::size_t) override
+  void deallocate_fast(void *ptr, std::size_t bytes, std::size_t alignment)
   {
-    // Do nothing.
+    const auto p = static_cast<std::byte *>(ptr);
+    header h;
+    detail::asan_unpoison(p - sizeof(header), sizeof(header));
+    std::memcpy(&h, p - sizeof(header), sizeof(header));
+    if (h.magic != (live_magic ^ address_of(p)))
+    {
+      report(h.magic == (freed_magic ^ address_of(p))
+               ? "memory deallocated twice"
+               : "memory not allocated by this resource, or its header was "
+                 "overwritten",
+             p);
+      return;
+    }
+
+    if (h.bytes != bytes || h.alignment != alignment)
+      report("deallocation size or alignment differs from the allocation's",
+             p);
+
+    const auto offset = header_offset(h.red_zone, h.alignment);
+    const auto base = p - offset;
+    const auto size = offset + h.bytes + h.red_zone;
+    detail::asan_unpoison(base, size);
+    if (h.red_zone != 0)
+    {
+      if (!is_filled(p - sizeof(header) - h.red_zone, h.red_zone))
+        report("write before the start of an allocation", p);
+      if (!is_filled(p + h.bytes, h.red_zone))
+        report("write past the end of an allocation", p);
+      if (opts.fill_memory)
+        std::memset(p, freed_byte, h.bytes);
+    }
+
+    // Double deallocations are caught as long as upstream doesn't reuse the
+    // header's memory in the meantime.
+    h.magic = freed_magic ^ address_of(p);
+    std::memcpy(p - sizeof(header), &h, sizeof(header));
+    upstream->deallocate(base, size, std::max(h.alignment, alignof(header)));
+  }
+
+protected:
+  void *do_allocate(std::size_t bytes, std::size_t alignment) override
+  {
+    return allocate_fast(bytes, alignment);
+  }
+
+  void do_deallocate(void *p, std::size_t bytes,
+                     std::size_t alignment) override
+  {
+    deallocate_fast(p, bytes, alignment);
   }
 
   bool do_is_equal(const memory_resource &other) const noexcept override
@@ -509,77 +4164,237 @@ protected:
   }
 
 private:
-  // Upstream memory resource from which we allocate regions.
+  // Stored right before every allocation. An underrun overwrites the magic
+  // number first, so it's last.
+  struct header
+  {
+    std::size_t bytes;
+    std::size_t alignment;
+    std::size_t red_zone; ///< Bytes of each canary, or zero if unchecked.
+    std::uintptr_t magic; ///< `live_magic` or `freed_magic`, xor the address.
+  };
+
+  static constexpr std::uintptr_t live_magic =
+    static_cast<std::uintptr_t>(0x5ca1ab1e0ddba11ull);
+  static constexpr std::uintptr_t freed_magic =
+    static_cast<std::uintptr_t>(0xdeadbeefdefacedull);
+
+  static std::uintptr_t address_of(const void *p) noexcept
+  {
+    return reinterpret_cast<std::uintptr_t>(p);
+  }
+
+  // Bytes from the start of the upstream allocation to the user's: the
+  // header and the front canary, aligned.
+  static std::size_t header_offset(std::size_t red_zone,
+                                   std::size_t alignment) noexcept
+  {
+    return detail::round_up(sizeof(header) + red_zone,
+                            std::max(alignment, alignof(header)));
+  }
+
+  static bool is_filled(const std::byte *p, std::size_t n) noexcept
+  {
+    return std::all_of(p, p + n, [](std::byte b) {
+      return b == std::byte(canary_byte);
+    });
+  }
+
+  bool sample() const noexcept
+  {
+    auto &countdown = detail::debug_sample_countdown;
+    if (countdown != 0)
+    {
+      --countdown;
+      return false;
+    }
+    countdown = opts.sample_interval - 1;
+    return true;
+  }
+
+  void report(const char *message, const void *p) const
+  {
+    error_count.fetch_add(1, std::memory_order_relaxed);
+    if (opts.on_error)
+      return opts.on_error(opts.error_context, message, p);
+    std::fprintf(stderr, "debug_resource: %s (%p)\n", message, p);
+    std::abort();
+  }
+
+  // Upstream memory resource to which we forward allocations.
   memory_resource *upstream;
 
-  std::byte *region_base_ptr = nullptr; ///< Current region.
-  std::byte *region_cur_ptr = nullptr; ///< Current free space in the region.
-  std::byte *region_end_ptr = nullptr; ///< End of the region.
-  std::size_t next_region_size = 4096; ///< Size of the next allocated region.
+  debug_options opts;
+  mutable std::atomic<std::size_t> error_count{0}; ///< Errors reported.
+};
 
-  // Whether we allocated the region ourselves. Only the first region may be
-  // unowned.
-  bool owns_region = false;
+// Functions a malloc_resource allocates and deallocates with. `deallocate`
+// gets the same size and alignment `allocate` got, so it can be hooked to
+// sized deallocation functions such as jemalloc's `sdallocx`. Neither is
+// called with an alignment that isn't a power of two.
+struct malloc_hooks
+{
+  // Returns null or throws on failure.
+  void *(*allocate)(std::size_t bytes, std::size_t alignment);
+  void (*deallocate)(void *p, std::size_t bytes, std::size_t alignment);
+};
 
-  // Information about a region allocated by this monotonic buffer resource. The
-  // first bytes of an owned region contain the following structure.
-  //
-  // This approach effectively creates a linked list of regions, connecting the
-  // last region to the previous one and so on.
-  struct owned_region_header
+// A memory resource that allocates with `malloc`, or `aligned_alloc` for
+// alignments above `alignof(std::max_align_t)`, and deallocates with `free`,
+// unless it's given hooks to call instead.
+//
+// Resources with the same hooks compare equal, as they can deallocate each
+// other's memory.
+class malloc_resource : public memory_resource
+{
+public:
+  constexpr malloc_resource() noexcept
+    : hooks{malloc_allocate, malloc_deallocate}
+  {}
+
+  explicit malloc_resource(const malloc_hooks &hooks) noexcept : hooks(hooks)
   {
-    std::byte *prev_region_base_ptr;
-    std::byte *prev_region_end_ptr;
-    bool owns_prev_region;
-  };
+    assert(hooks.allocate && hooks.deallocate);
+  }
+
+  malloc_hooks get_hooks() const noexcept { return hooks; }
 
-  constexpr std::size_t compute_next_grow(std::size_t reg_size) const
+  // Allocates like `allocate`, except it isn't virtual, so it can be inlined
+  // when the resource type is known.
+  [[nodiscard]] void *
+  allocate_fast(std::size_t bytes,
+                std::size_t alignment = alignof(std::max_align_t))
   {
-    return reg_size * 2;
+    assert(alignment > 0 && (alignment & (alignment - 1)) == 0);
+    if (const auto p = hooks.allocate(bytes, alignment))
+      return p;
+    throw std::bad_alloc();
   }
 
-  std::size_t region_size() const
+  void deallocate_fast(void *p, std::size_t bytes,
+                       std::size_t alignment) noexcept
   {
-    return static_cast<std::size_t>(region_end_ptr - region_base_ptr);
+    hooks.deallocate(p, bytes, alignment);
+  }
+
+protected:
+  void *do_allocate(std::size_t bytes, std::size_t alignment) override
+  {
+    return allocate_fast(bytes, alignment);
+  }
+
+  void do_deallocate(void *p, std::size_t bytes,
+                     std::size_t alignment) override
+  {
+    deallocate_fast(p, bytes, alignment);
+  }
+
+  bool do_is_equal(const memory_resource &other) const noexcept override
+  {
+    const auto r = dynamic_cast<const malloc_resource *>(&other);
+    return r && r->hooks.allocate == hooks.allocate &&
+           r->hooks.deallocate == hooks.deallocate;
+  }
+
+private:
+  static void *malloc_allocate(std::size_t bytes,
+                               std::size_t alignment) noexcept
+  {
+    if (bytes == 0)
+      bytes = 1;
+    if (alignment <= alignof(std::max_align_t))
+      return std::malloc(bytes);
+#if defined(_WIN32)
+    return _aligned_malloc(bytes, alignment);
+#else
+    // The size passed to aligned_alloc must be a multiple of the alignment.
+    return std::aligned_alloc(alignment, detail::round_up(bytes, alignment));
+#endif
+  }
+
+  static void malloc_deallocate(void *p, std::size_t,
+                                std::size_t alignment) noexcept
+  {
+#if defined(_WIN32)
+    if (alignment > alignof(std::max_align_t))
+      return _aligned_free(p);
+#else
+    (void)alignment;
+#endif
+    std::free(p);
   }
+
+  malloc_hooks hooks;
 };
 
-inline memory_resource *new_delete_resource() noexcept
+namespace detail {
+// Holds a `T` that's constant-initialized and never destroyed, so that it's
+// usable from before any dynamic initialization until after every exit-time
+// destructor.
+template <class T>
+union never_destroyed
 {
-  struct type : memory_resource
+  constexpr never_destroyed() : value() {}
+  ~never_destroyed() {}
+
+  T value;
+};
+
+class new_delete_memory_resource : public memory_resource
+{
+protected:
+  void *do_allocate(std::size_t bytes, std::size_t alignment) override
   {
-    void *do_allocate(std::size_t bytes, std::size_t alignment) override
+    if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
     {
-      if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
-      {
-        auto al = std::align_val_t(alignment);
-        return ::operator new(bytes, al);
-      }
-      return ::operator new(bytes);
+      auto al = std::align_val_t(alignment);
+      return ::operator new(bytes, al);
     }
+    return ::operator new(bytes);
+  }
 
-    void do_deallocate(void *p, std::size_t,
-                       std::size_t alignment) noexcept override
+  // Passing the size lets allocators such as jemalloc and tcmalloc skip
+  // looking up the size class of `p`.
+  void do_deallocate(void *p, std::size_t bytes,
+                     std::size_t alignment) noexcept override
+  {
+#if defined(__cpp_sized_deallocation)
+    if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
     {
-      if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
-      {
-        auto al = std::align_val_t(alignment);
-        return ::operator delete(p, al);
-      }
-      return ::operator delete(p);
+      auto al = std::align_val_t(alignment);
+      return ::operator delete(p, bytes, al);
     }
-
-    bool do_is_equal(const memory_resource &other) const noexcept override
+    return ::operator delete(p, bytes);
+#else
+    (void)bytes;
+    if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
     {
-      return this == &other;
+      auto al = std::align_val_t(alignment);
+      return ::operator delete(p, al);
     }
-  };
+    return ::operator delete(p);
+#endif
+  }
 
-  // Constructing the memory resource this way ensures that no exit-time
-  // destructors will be called.
-  alignas(type) static char buffer[sizeof(type)];
-  static memory_resource *mr = new (buffer) type;
-  return mr;
+  bool do_is_equal(const memory_resource &other) const noexcept override
+  {
+    return this == &other;
+  }
+};
+
+inline never_destroyed<new_delete_memory_resource> new_delete_instance;
+inline never_destroyed<malloc_resource> malloc_instance;
+} // namespace detail
+
+inline memory_resource *new_delete_resource() noexcept
+{
+  return &detail::new_delete_instance.value;
+}
+
+// A malloc_resource without hooks, which is never destroyed.
+inline memory_resource *malloc_memory_resource() noexcept
+{
+  return &detail::malloc_instance.value;
 }
 
 inline memory_resource *null_memory_resource() noexcept
@@ -607,24 +4422,179 @@ inline memory_resource *null_memory_resource() noexcept
 }
 
 namespace detail {
-inline std::atomic<memory_resource *> &get_default_resource_impl() noexcept
+// The default resource set with set_default_resource. Both it and the
+// new_delete_resource() it starts out as are constant-initialized, so reading
+// it has neither a guard for a function-local static nor a dependency on
+// initialization order.
+inline std::atomic<memory_resource *>
+  default_resource(&new_delete_instance.value);
+
+// Overrides the default resource for the calling thread when not null.
+inline thread_local memory_resource *thread_default_resource = nullptr;
+
+// The default resource set with set_default_resource, ignoring the calling
+// thread's override.
+inline memory_resource *global_default_resource() noexcept
 {
-  static std::atomic<memory_resource *> r(new_delete_resource());
-  return r;
+  // Acquire pairs with the release in set_default_resource, so that the
+  // resource is seen fully constructed by whoever installed it.
+  return default_resource.load(std::memory_order_acquire);
 }
 } // namespace detail
 
 inline memory_resource *get_default_resource() noexcept
 {
-  return detail::get_default_resource_impl().load();
+  if (const auto r = detail::thread_default_resource)
+    return r;
+  return detail::global_default_resource();
 }
 
 inline memory_resource *set_default_resource(memory_resource *r) noexcept
 {
   if (!r)
     r = new_delete_resource();
-  return detail::get_default_resource_impl().exchange(r);
+  return detail::default_resource.exchange(r, std::memory_order_acq_rel);
+}
+
+// Makes `r` the default resource of the calling thread only, taking
+// precedence over the one set with set_default_resource. Passing null
+// removes the override. Returns the previous override, which may be null.
+//
+// Unlike the global default, the override isn't shared between threads, so
+// each thread may install its own arena without any contention.
+inline memory_resource *set_thread_default_resource(memory_resource *r) noexcept
+{
+  const auto prev = detail::thread_default_resource;
+  detail::thread_default_resource = r;
+  return prev;
 }
 
+namespace detail {
+// The calling thread's arena, or null if it has none. Being a plain pointer,
+// it's constant-initialized, so reading it is a single thread-local access.
+inline thread_local monotonic_buffer_resource *thread_arena_ptr = nullptr;
+
+// Owns the calling thread's arena, and destroys it when the thread exits.
+struct thread_arena_holder
+{
+  thread_arena_holder() = default;
+  thread_arena_holder(const thread_arena_holder &) = delete;
+  thread_arena_holder &operator=(const thread_arena_holder &) = delete;
+
+  ~thread_arena_holder() { destroy(); }
+
+  void destroy() noexcept
+  {
+    if (!arena)
+      return;
+    // Thread-local objects destroyed after this one may still allocate from
+    // the default resource.
+    if (thread_default_resource == &*arena)
+      thread_default_resource = nullptr;
+    thread_arena_ptr = nullptr;
+    arena.reset();
+  }
+
+  static thread_arena_holder &local() noexcept
+  {
+    static thread_local thread_arena_holder holder;
+    return holder;
+  }
+
+  std::optional<monotonic_buffer_resource> arena;
+};
+} // namespace detail
+
+// A monotonic_buffer_resource of each thread's own, created the first time
+// the thread uses it, and destroyed when the thread exits. Installed as the
+// thread's default resource, it makes scratch allocations through
+// default-constructed polymorphic_allocators a pointer bump, without touching
+// any shared state.
+//
+// Memory allocated from an arena must only be used by its thread, or handed
+// to other threads which are done with it before the arena is reset.
+class thread_arena
+{
+public:
+  thread_arena() = delete;
+
+  // Returns the calling thread's arena, creating it with default options
+  // if it has none yet. Its upstream is the global default resource.
+  static monotonic_buffer_resource &get()
+  {
+    if (const auto arena = detail::thread_arena_ptr)
+      return *arena;
+    return create(monotonic_options(), detail::global_default_resource());
+  }
+
+  // Creates the calling thread's arena, destroying the one it had, if any.
+  static monotonic_buffer_resource &create(const monotonic_options &opts,
+                                           memory_resource *upstream)
+  {
+    auto &holder = detail::thread_arena_holder::local();
+    holder.destroy();
+    holder.arena.emplace(opts, upstream);
+    detail::thread_arena_ptr = &*holder.arena;
+    return *holder.arena;
+  }
+
+  // Whether the calling thread has an arena.
+  static bool exists() noexcept { return detail::thread_arena_ptr; }
+
+  // Destroys the calling thread's arena, giving all its memory back.
+  static void destroy() noexcept
+  {
+    if (detail::thread_arena_ptr)
+      detail::thread_arena_holder::local().destroy();
+  }
+
+  // Frees everything allocated from the calling thread's arena, keeping its
+  // largest region for the allocations that follow. Meant to be called at
+  // task boundaries.
+  static void reset()
+  {
+    if (const auto arena = detail::thread_arena_ptr)
+      arena->reset();
+  }
+
+  // Makes the calling thread's arena its default resource, creating the
+  // arena if needed. Returns the thread's previous override.
+  static memory_resource *install()
+  {
+    return set_thread_default_resource(&get());
+  }
+
+  // Stops the calling thread's arena from being its default resource.
+  static void uninstall() noexcept
+  {
+    const auto arena = detail::thread_arena_ptr;
+    if (arena && detail::thread_default_resource == arena)
+      set_thread_default_resource(nullptr);
+  }
+
+  // Installs the calling thread's arena as its default resource for as long
+  // as it lives, and then frees everything allocated from the arena in the
+  // meantime, and restores the previous default. Scopes may be nested, but
+  // the arena must not be destroyed or created again while one is alive.
+  class scope
+  {
+  public:
+    scope() : prev(install()), cp(detail::thread_arena_ptr->mark()) {}
+
+    scope(const scope &) = delete;
+    scope &operator=(const scope &) = delete;
+
+    ~scope()
+    {
+      detail::thread_arena_ptr->rewind(cp);
+      set_thread_default_resource(prev);
+    }
+
+  private:
+    memory_resource *prev;
+    monotonic_buffer_resource::checkpoint cp;
+  };
+};
+
 } // namespace feroldi::pmr
 #endif
@@ -0,0 +1,338 @@
+// Copyright (c) 2018 Mário Feroldi
+//
+// Distributed under the Boost Software License, Version 1.0.
+// See accompanying file LICENSE or copy at
+// http://www.boost.org/LICENSE_1_0.txt
+
+#ifndef FEROLDI_CXX17_MONOTONIC_VECTOR
+#define FEROLDI_CXX17_MONOTONIC_VECTOR
+
+#include "memory_resource.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace feroldi::pmr {
+
+// A vector whose storage comes from a monotonic_buffer_resource. When it's
+// the most recent allocation from the resource, as it is for a vector being
+// appended to, storage grows in place with `try_expand`, without moving the
+// elements or leaving the old storage behind as waste.
+template <class T>
+class monotonic_vector
+{
+public:
+  using value_type = T;
+  using size_type = std::size_t;
+  using difference_type = std::ptrdiff_t;
+  using reference = T &;
+  using const_reference = const T &;
+  using pointer = T *;
+  using const_pointer = const T *;
+  using iterator = T *;
+  using const_iterator = const T *;
+  using reverse_iterator = std::reverse_iterator<iterator>;
+  using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+  explicit monotonic_vector(monotonic_buffer_resource *r) noexcept : res(r)
+  {
+    assert(r);
+  }
+
+  monotonic_vector(std::initializer_list<T> init,
+                   monotonic_buffer_resource *r)
+    : monotonic_vector(init.begin(), init.end(), r)
+  {}
+
+  template <class InputIt,
+            class = typename std::iterator_traits<InputIt>::iterator_category>
+  monotonic_vector(InputIt first, InputIt last, monotonic_buffer_resource *r)
+    : monotonic_vector(r)
+  {
+    for (; first != last; ++first)
+      emplace_back(*first);
+  }
+
+  // Copies use the same resource.
+  monotonic_vector(const monotonic_vector &other)
+    : monotonic_vector(other.begin(), other.end(), other.res)
+  {}
+
+  monotonic_vector(monotonic_vector &&other) noexcept
+    : res(other.res)
+    , first(std::exchange(other.first, nullptr))
+    , count(std::exchange(other.count, 0))
+    , cap(std::exchange(other.cap, 0))
+  {}
+
+  ~monotonic_vector()
+  {
+    clear();
+    deallocate_storage();
+  }
+
+  monotonic_vector &operator=(const monotonic_vector &other)
+  {
+    if (this != &other)
+      assign(other.begin(), other.end());
+    return *this;
+  }
+
+  // Storage is only taken from `other` when both use the same resource.
+  monotonic_vector &operator=(monotonic_vector &&other)
+  {
+    if (this == &other)
+      return *this;
+    if (res != other.res)
+    {
+      assign(std::make_move_iterator(other.begin()),
+             std::make_move_iterator(other.end()));
+      return *this;
+    }
+
+    clear();
+    deallocate_storage();
+    first = std::exchange(other.first, nullptr);
+    count = std::exchange(other.count, 0);
+    cap = std::exchange(other.cap, 0);
+    return *this;
+  }
+
+  template <class InputIt>
+  void assign(InputIt first_it, InputIt last_it)
+  {
+    clear();
+    for (; first_it != last_it; ++first_it)
+      emplace_back(*first_it);
+  }
+
+  monotonic_buffer_resource *resource() const noexcept { return res; }
+
+  iterator begin() noexcept { return first; }
+  const_iterator begin() const noexcept { return first; }
+  const_iterator cbegin() const noexcept { return first; }
+  iterator end() noexcept { return first + count; }
+  const_iterator end() const noexcept { return first + count; }
+  const_iterator cend() const noexcept { return first + count; }
+  reverse_iterator rbegin() noexcept { return reverse_iterator(end()); }
+  const_reverse_iterator rbegin() const noexcept
+  {
+    return const_reverse_iterator(end());
+  }
+  reverse_iterator rend() noexcept { return reverse_iterator(begin()); }
+  const_reverse_iterator rend() const noexcept
+  {
+    return const_reverse_iterator(begin());
+  }
+
+  bool empty() const noexcept { return count == 0; }
+  size_type size() const noexcept { return count; }
+  size_type capacity() const noexcept { return cap; }
+
+  T *data() noexcept { return first; }
+  const T *data() const noexcept { return first; }
+
+  reference operator[](size_type i) noexcept
+  {
+    assert(i < count);
+    return first[i];
+  }
+
+  const_reference operator[](size_type i) const noexcept
+  {
+    assert(i < count);
+    return first[i];
+  }
+
+  reference front() noexcept { return (*this)[0]; }
+  const_reference front() const noexcept { return (*this)[0]; }
+  reference back() noexcept { return (*this)[count - 1]; }
+  const_reference back() const noexcept { return (*this)[count - 1]; }
+
+  void reserve(size_type n)
+  {
+    if (n > cap)
+      reallocate(n);
+  }
+
+  // Gives unused capacity back to the resource, which it can only reclaim
+  // while the storage is its most recent allocation.
+  void shrink_to_fit() noexcept
+  {
+    if (cap > count &&
+        res->try_shrink(first, cap * sizeof(T), count * sizeof(T)))
+      cap = count;
+  }
+
+  void clear() noexcept
+  {
+    std::destroy(begin(), end());
+    count = 0;
+  }
+
+  template <class... Args>
+  reference emplace_back(Args &&... args)
+  {
+    if (count == cap)
+    {
+      // The new element is constructed before growing, as `args` may refer
+      // to an element that gets moved.
+      if (!first || !res->try_expand(first, cap * sizeof(T),
+                                     grown_capacity(count + 1) * sizeof(T)))
+      {
+        T value(std::forward<Args>(args)...);
+        reallocate(grown_capacity(count + 1));
+        ::new (static_cast<void *>(first + count)) T(std::move(value));
+        return first[count++];
+      }
+      cap = grown_capacity(count + 1);
+    }
+
+    ::new (static_cast<void *>(first + count)) T(std::forward<Args>(args)...);
+    return first[count++];
+  }
+
+  void push_back(const T &value) { emplace_back(value); }
+  void push_back(T &&value) { emplace_back(std::move(value)); }
+
+  void pop_back() noexcept
+  {
+    assert(count > 0);
+    std::destroy_at(first + --count);
+  }
+
+  template <class... Args>
+  iterator emplace(const_iterator pos, Args &&... args)
+  {
+    const auto index = static_cast<size_type>(pos - begin());
+    assert(index <= count);
+    if (index == count)
+    {
+      emplace_back(std::forward<Args>(args)...);
+      return begin() + index;
+    }
+
+    T value(std::forward<Args>(args)...);
+    emplace_back(std::move(back()));
+    std::move_backward(begin() + index, end() - 2, end() - 1);
+    first[index] = std::move(value);
+    return begin() + index;
+  }
+
+  iterator insert(const_iterator pos, const T &value)
+  {
+    return emplace(pos, value);
+  }
+
+  iterator insert(const_iterator pos, T &&value)
+  {
+    return emplace(pos, std::move(value));
+  }
+
+  iterator erase(const_iterator pos) { return erase(pos, pos + 1); }
+
+  iterator erase(const_iterator first_it, const_iterator last_it)
+  {
+    const auto from = begin() + (first_it - begin());
+    const auto to = begin() + (last_it - begin());
+    if (from != to)
+    {
+      const auto new_end = std::move(to, end(), from);
+      std::destroy(new_end, end());
+      count = static_cast<size_type>(new_end - begin());
+    }
+    return from;
+  }
+
+  void resize(size_type n)
+  {
+    while (count > n)
+      pop_back();
+    reserve(n);
+    while (count < n)
+      emplace_back();
+  }
+
+  void resize(size_type n, const T &value)
+  {
+    while (count > n)
+      pop_back();
+    reserve(n);
+    while (count < n)
+      emplace_back(value);
+  }
+
+  friend bool operator==(const monotonic_vector &a, const monotonic_vector &b)
+  {
+    return std::equal(a.begin(), a.end(), b.begin(), b.end());
+  }
+
+  friend bool operator!=(const monotonic_vector &a, const monotonic_vector &b)
+  {
+    return !(a == b);
+  }
+
+private:
+  size_type grown_capacity(size_type min_size) const noexcept
+  {
+    return std::max({min_size, cap * 2, size_type(4)});
+  }
+
+  // Moves the elements to new storage of `n` elements, unless the current
+  // storage can be grown in place.
+  void reallocate(size_type n)
+  {
+    assert(n > cap);
+    if (first && res->try_expand(first, cap * sizeof(T), n * sizeof(T)))
+    {
+      cap = n;
+      return;
+    }
+
+    const auto new_first =
+      static_cast<T *>(res->allocate_fast(n * sizeof(T), alignof(T)));
+    if constexpr (std::is_nothrow_move_constructible_v<T> ||
+                  !std::is_copy_constructible_v<T>)
+      std::uninitialized_move(begin(), end(), new_first);
+    else
+    {
+      try
+      {
+        std::uninitialized_copy(begin(), end(), new_first);
+      }
+      catch (...)
+      {
+        res->try_shrink(new_first, n * sizeof(T), 0);
+        throw;
+      }
+    }
+
+    std::destroy(begin(), end());
+    deallocate_storage();
+    first = new_first;
+    cap = n;
+  }
+
+  void deallocate_storage() noexcept
+  {
+    if (first)
+      res->try_shrink(first, cap * sizeof(T), 0);
+    first = nullptr;
+    cap = 0;
+  }
+
+  monotonic_buffer_resource *res;
+  T *first = nullptr;
+  size_type count = 0;
+  size_type cap = 0;
+};
+
+} // namespace feroldi::pmr
+#endif
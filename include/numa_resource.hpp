@@ -0,0 +1,250 @@
+// Copyright (c) 2018 Mário Feroldi
+//
+// Distributed under the Boost Software License, Version 1.0.
+// See accompanying file LICENSE or copy at
+// http://www.boost.org/LICENSE_1_0.txt
+
+#ifndef FEROLDI_CXX17_NUMA_RESOURCE
+#define FEROLDI_CXX17_NUMA_RESOURCE
+
+#include "memory_resource.hpp"
+#include "page_resource.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdio>
+#include <memory>
+#include <new>
+#include <optional>
+
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace feroldi::pmr {
+
+namespace detail {
+
+// Node of the CPU the calling thread runs on.
+inline int current_numa_node() noexcept
+{
+#if defined(__linux__) && defined(SYS_getcpu)
+  unsigned cpu = 0;
+  unsigned node = 0;
+// Not __GLIBC_PREREQ, which doesn't parse where glibc doesn't define it.
+#if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29)
+  if (getcpu(&cpu, &node) == 0)
+    return static_cast<int>(node);
+#else
+  if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0)
+    return static_cast<int>(node);
+#endif
+#endif
+  return 0;
+}
+
+// Number of nodes of the system, counting from zero up to the highest one.
+inline int numa_node_count() noexcept
+{
+#if defined(__linux__)
+  // The file holds a list of ranges, such as "0-1" or "0,2-3", whose last
+  // number is the highest node.
+  static const int count = [] {
+    int highest = 0;
+    if (const auto file = std::fopen("/sys/devices/system/node/possible", "r"))
+    {
+      int n;
+      char separator;
+      while (std::fscanf(file, "%d%c", &n, &separator) >= 1)
+        highest = n;
+      std::fclose(file);
+    }
+    return highest + 1;
+  }();
+  return count;
+#else
+  return 1;
+#endif
+}
+
+} // namespace detail
+
+// A page_resource whose memory is bound to a node of a NUMA system, either a
+// fixed one, or the node of the thread that allocates it.
+//
+// Binding is done with `mbind`, through its system call, so there's no need
+// to link with libnuma. It's only done on Linux; elsewhere, this is a
+// page_resource.
+class numa_resource : public page_resource
+{
+public:
+  // Binds each allocation to the node of the thread that makes it.
+  static constexpr int local_node = -1;
+
+  explicit numa_resource(int node = local_node,
+                         const page_options &opts = page_options(),
+                         bool strict = false)
+    : page_resource(without_populate(opts))
+    , bound_node(node)
+    , strict(strict)
+    , populate(opts.populate)
+  {}
+
+  // Node to which memory is bound, or `local_node`.
+  int node() const noexcept { return bound_node; }
+
+  // Whether allocations fail, rather than use another node, when the node
+  // is out of memory.
+  bool is_strict() const noexcept { return strict; }
+
+  static int current_node() noexcept { return detail::current_numa_node(); }
+  static int node_count() noexcept { return detail::numa_node_count(); }
+
+protected:
+  void *do_allocate(std::size_t bytes, std::size_t alignment) override
+  {
+    const auto p = page_resource::do_allocate(bytes, alignment);
+    const auto size = mapping_size(bytes);
+    bind(p, size, bound_node == local_node ? current_node() : bound_node);
+
+    // Pages are faulted in only once they're bound, or else they'd be
+    // placed by the thread's policy.
+    if (populate)
+    {
+#if defined(MADV_POPULATE_WRITE)
+      if (madvise(p, size, MADV_POPULATE_WRITE) == 0)
+        return p;
+#endif
+      const auto page = page_size();
+      for (std::size_t offset = 0; offset < size; offset += page)
+        static_cast<volatile char *>(p)[offset] = 0;
+    }
+    return p;
+  }
+
+private:
+  static page_options without_populate(page_options opts) noexcept
+  {
+    opts.populate = false;
+    return opts;
+  }
+
+  void bind(void *p, std::size_t size, int node) const noexcept
+  {
+#if defined(__linux__) && defined(SYS_mbind)
+    constexpr int mpol_preferred = 1;
+    constexpr int mpol_bind = 2;
+    constexpr auto bits = sizeof(unsigned long) * 8;
+
+    unsigned long mask[16] = {};
+    if (node < 0 || static_cast<std::size_t>(node) >= bits * 16)
+      return;
+    mask[node / bits] = 1ul << (node % bits);
+
+    // Failing to bind isn't an error, because the memory is still usable.
+    syscall(SYS_mbind, p, size, strict ? mpol_bind : mpol_preferred, mask,
+            bits * 16, 0);
+#else
+    (void)p;
+    (void)size;
+    (void)node;
+#endif
+  }
+
+  int bound_node;
+  bool strict;
+  bool populate; ///< Whether to fault pages in once they're bound.
+};
+
+// A memory resource that has a `Resource` on every node, whose upstream is a
+// numa_resource bound to that node, and sends each allocation to the
+// resource of the allocating thread's node.
+//
+// Memory deallocated from another node goes back to the resource that
+// allocated it, which is found in a header before each block. `Resource` has
+// to be thread-safe if the router is used by many threads, which is why it
+// defaults to synchronized_pool_resource.
+template <class Resource = synchronized_pool_resource>
+class numa_router_resource : public memory_resource
+{
+public:
+  explicit numa_router_resource(const page_options &opts = page_options())
+    : count(numa_resource::node_count())
+    , nodes(std::make_unique<per_node[]>(static_cast<std::size_t>(count)))
+  {
+    for (int n = 0; n < count; ++n)
+    {
+      auto &node = nodes[static_cast<std::size_t>(n)];
+      node.upstream.emplace(n, opts);
+      node.resource.emplace(&*node.upstream);
+    }
+  }
+
+  numa_router_resource(const numa_router_resource &) = delete;
+  numa_router_resource &operator=(const numa_router_resource &) = delete;
+
+  int node_count() const noexcept { return count; }
+
+  // The resource that allocates for threads on `node`.
+  Resource &node_resource(int node) noexcept
+  {
+    assert(node >= 0 && node < count);
+    return *nodes[static_cast<std::size_t>(node)].resource;
+  }
+
+protected:
+  void *do_allocate(std::size_t bytes, std::size_t alignment) override
+  {
+    auto node = numa_resource::current_node();
+    if (node < 0 || node >= count)
+      node = 0;
+
+    alignment = std::max(alignment, alignof(header));
+    const auto offset = header_offset(alignment);
+    const auto p = static_cast<char *>(
+      node_resource(node).allocate(offset + bytes, alignment));
+    ::new (p + offset - sizeof(header)) header{node};
+    return p + offset;
+  }
+
+  void do_deallocate(void *p, std::size_t bytes, std::size_t alignment) override
+  {
+    alignment = std::max(alignment, alignof(header));
+    const auto offset = header_offset(alignment);
+    const auto h = reinterpret_cast<header *>(static_cast<char *>(p) -
+                                              sizeof(header));
+    node_resource(h->node).deallocate(static_cast<char *>(p) - offset,
+                                      offset + bytes, alignment);
+  }
+
+  bool do_is_equal(const memory_resource &other) const noexcept override
+  {
+    return this == &other;
+  }
+
+private:
+  struct header
+  {
+    int node;
+  };
+
+  struct per_node
+  {
+    std::optional<numa_resource> upstream;
+    std::optional<Resource> resource;
+  };
+
+  static constexpr std::size_t header_offset(std::size_t alignment) noexcept
+  {
+    return detail::round_up(sizeof(header), alignment);
+  }
+
+  int count;
+  std::unique_ptr<per_node[]> nodes;
+};
+
+} // namespace feroldi::pmr
+#endif
@@ -0,0 +1,324 @@
+// Copyright (c) 2018 Mário Feroldi
+//
+// Distributed under the Boost Software License, Version 1.0.
+// See accompanying file LICENSE or copy at
+// http://www.boost.org/LICENSE_1_0.txt
+
+#ifndef FEROLDI_CXX17_PAGE_RESOURCE
+#define FEROLDI_CXX17_PAGE_RESOURCE
+
+#include "memory_resource.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace feroldi::pmr {
+
+// Kind of pages backing the memory of a page_resource.
+enum class huge_pages
+{
+  none, ///< Regular pages.
+  transparent, ///< Ask the kernel to back mappings with huge pages if it can.
+  explicit_2mb, ///< Map 2 MiB pages explicitly, which must be reserved.
+  explicit_1gb, ///< Map 1 GiB pages explicitly, which must be reserved.
+};
+
+struct page_options
+{
+  huge_pages huge = huge_pages::none;
+
+  // Whether pages are faulted in when they're mapped, rather than when
+  // they're first touched.
+  bool populate = false;
+
+  // Whether to map regular pages when explicit huge pages can't be mapped,
+  // instead of failing.
+  bool fallback_to_small_pages = true;
+
+  // Up to this many bytes of deallocated mappings are kept and reused, rather
+  // than unmapped. Their physical pages are given back to the system right
+  // away all the same (with `madvise(MADV_DONTNEED)`), so this only saves the
+  // cost of mapping them again.
+  std::size_t max_cached_bytes = 0;
+};
+
+// A memory resource which maps memory directly from the operating system,
+// with `mmap` or `VirtualAlloc`. Every allocation gets a mapping of its own,
+// rounded up to a whole number of pages, so it's meant as the upstream of
+// other resources (such as monotonic_buffer_resource) that allocate large
+// regions from it.
+//
+// It's thread-safe.
+class page_resource : public memory_resource
+{
+public:
+  explicit page_resource(const page_options &opts = page_options())
+    : opts(opts)
+  {}
+
+  page_resource(const page_resource &) = delete;
+  page_resource &operator=(const page_resource &) = delete;
+
+  virtual ~page_resource() override
+  {
+    for (std::size_t i = 0; i < cached_count; ++i)
+      unmap(cached[i].p, cached[i].size);
+  }
+
+  page_options options() const { return opts; }
+
+  // Size of regular pages.
+  static std::size_t page_size() noexcept
+  {
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+#else
+    static const auto size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    return size;
+#endif
+  }
+
+  // Size of the pages backing mappings, according to the options.
+  std::size_t mapping_granularity() const noexcept
+  {
+    switch (opts.huge)
+    {
+      case huge_pages::transparent:
+      case huge_pages::explicit_2mb: return std::size_t(2) << 20;
+      case huge_pages::explicit_1gb: return std::size_t(1) << 30;
+      case huge_pages::none: break;
+    }
+    return page_size();
+  }
+
+  // Size of the mapping backing an allocation of `bytes`.
+  std::size_t mapping_size(std::size_t bytes) const noexcept
+  {
+    return detail::round_up(bytes == 0 ? 1 : bytes, mapping_granularity());
+  }
+
+  // Gives the physical pages of `[p, p + bytes)` back to the system, while
+  // keeping the memory mapped. Their contents are lost.
+  static void decommit(void *p, std::size_t bytes) noexcept
+  {
+#if defined(_WIN32)
+    VirtualAlloc(p, bytes, MEM_RESET, PAGE_READWRITE);
+#else
+    madvise(p, bytes, MADV_DONTNEED);
+#endif
+  }
+
+protected:
+  void *do_allocate(std::size_t bytes, std::size_t alignment) override
+  {
+    const auto size = mapping_size(bytes);
+    if (const auto p = take_cached(size, alignment))
+      return p;
+
+    if (const auto p = map(size, alignment, opts.huge))
+      return p;
+
+    const bool is_explicit = opts.huge == huge_pages::explicit_2mb ||
+                             opts.huge == huge_pages::explicit_1gb;
+    if (is_explicit && opts.fallback_to_small_pages)
+    {
+      if (const auto p = map(size, alignment, huge_pages::none))
+        return p;
+    }
+
+    throw std::bad_alloc();
+  }
+
+  void do_deallocate(void *p, std::size_t bytes, std::size_t) override
+  {
+    const auto size = mapping_size(bytes);
+    if (!put_cached(p, size))
+      unmap(p, size);
+  }
+
+  bool do_is_equal(const memory_resource &other) const noexcept override
+  {
+    return this == &other;
+  }
+
+private:
+  // Maps `size` bytes aligned to `alignment`, or returns null on failure.
+  void *map(std::size_t size, std::size_t alignment, huge_pages huge) const
+  {
+#if defined(_WIN32)
+    DWORD type = MEM_RESERVE | MEM_COMMIT;
+    if (huge == huge_pages::explicit_2mb || huge == huge_pages::explicit_1gb)
+      type |= MEM_LARGE_PAGES;
+
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    if (alignment <= info.dwAllocationGranularity)
+      return VirtualAlloc(nullptr, size, type, PAGE_READWRITE);
+
+    // Windows can't unmap part of a mapping, so an aligned address is found
+    // by reserving a larger range, and mapping the aligned part of it after
+    // releasing it. Another thread may take the address in between, so this
+    // is retried a few times.
+    for (int attempt = 0; attempt < 8; ++attempt)
+    {
+      const auto probe =
+        VirtualAlloc(nullptr, size + alignment, MEM_RESERVE, PAGE_NOACCESS);
+      if (!probe)
+        return nullptr;
+      VirtualFree(probe, 0, MEM_RELEASE);
+
+      const auto aligned = reinterpret_cast<void *>(detail::round_up(
+        reinterpret_cast<std::uintptr_t>(probe), alignment));
+      if (const auto p = VirtualAlloc(aligned, size, type, PAGE_READWRITE))
+        return p;
+    }
+    return nullptr;
+#else
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#if defined(MAP_POPULATE)
+    if (opts.populate)
+      flags |= MAP_POPULATE;
+#endif
+    if (huge == huge_pages::explicit_2mb || huge == huge_pages::explicit_1gb)
+    {
+#if defined(MAP_HUGETLB)
+      // Explicit huge pages are aligned to their size already. The page size
+      // goes in the bits above MAP_HUGE_SHIFT, as its log2.
+      if (alignment > mapping_granularity())
+        return nullptr;
+      const int log2_size = huge == huge_pages::explicit_2mb ? 21 : 30;
+      flags |= MAP_HUGETLB | (log2_size << 26);
+      const auto p =
+        mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+      return p == MAP_FAILED ? nullptr : p;
+#else
+      return nullptr;
+#endif
+    }
+
+    // Mappings are page aligned. For larger alignments (which transparent
+    // huge pages need too), a larger range is mapped, and what's outside the
+    // aligned part of it is unmapped.
+    if (huge == huge_pages::transparent)
+      alignment = std::max(alignment, mapping_granularity());
+    alignment = std::max(alignment, page_size());
+    const auto extra = alignment - page_size();
+
+    const auto mapping =
+      mmap(nullptr, size + extra, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (mapping == MAP_FAILED)
+      return nullptr;
+
+    const auto base = reinterpret_cast<std::uintptr_t>(mapping);
+    const auto aligned = detail::round_up(base, alignment);
+    if (aligned != base)
+      munmap(mapping, aligned - base);
+    if (const auto tail = base + extra - aligned)
+      munmap(reinterpret_cast<void *>(aligned + size), tail);
+
+    const auto p = reinterpret_cast<void *>(aligned);
+#if defined(MADV_HUGEPAGE)
+    if (huge == huge_pages::transparent)
+      madvise(p, size, MADV_HUGEPAGE);
+#endif
+    return p;
+#endif
+  }
+
+  static void unmap(void *p, std::size_t size) noexcept
+  {
+#if defined(_WIN32)
+    (void)size;
+    VirtualFree(p, 0, MEM_RELEASE);
+#else
+    munmap(p, size);
+#endif
+  }
+
+  // Reuses a cached mapping of `size` bytes aligned to `alignment`.
+  void *take_cached(std::size_t size, std::size_t alignment)
+  {
+    if (opts.max_cached_bytes == 0)
+      return nullptr;
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    for (std::size_t i = 0; i < cached_count; ++i)
+    {
+      const auto p = cached[i].p;
+      if (cached[i].size == size &&
+          reinterpret_cast<std::uintptr_t>(p) % alignment == 0)
+      {
+        cached_bytes -= size;
+        cached[i] = cached[--cached_count];
+        return p;
+      }
+    }
+    return nullptr;
+  }
+
+  // Keeps a deallocated mapping for reuse, if there's room in the cache.
+  bool put_cached(void *p, std::size_t size)
+  {
+    if (size > opts.max_cached_bytes)
+      return false;
+
+    // Room is reserved first, so that a mapping which won't be kept is
+    // unmapped without being decommitted for nothing.
+    {
+      std::lock_guard<std::mutex> lock(cache_mutex);
+      if (cached_count + reserved_count == max_cached_mappings ||
+          size > opts.max_cached_bytes - cached_bytes)
+        return false;
+      ++reserved_count;
+      cached_bytes += size;
+    }
+
+    // This is done before the mapping is in the cache, as another thread
+    // may take it right away. Its pages are faulted in again when it's
+    // reused, even if `populate` is set.
+    decommit(p, size);
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    --reserved_count;
+    cached[cached_count++] = {p, size};
+    return true;
+  }
+
+  struct mapping
+  {
+    void *p;
+    std::size_t size;
+  };
+
+  static constexpr std::size_t max_cached_mappings = 16;
+
+  page_options opts;
+
+  std::mutex cache_mutex; ///< Guards the cache of mappings.
+  mapping cached[max_cached_mappings]; ///< Deallocated mappings kept.
+  std::size_t cached_count = 0; ///< Number of mappings in the cache.
+
+  // Number of mappings being decommitted to be put in the cache. Their room
+  // in it is taken, and their size is in `cached_bytes`.
+  std::size_t reserved_count = 0;
+
+  std::size_t cached_bytes = 0; ///< Total size of the cached mappings.
+};
+
+} // namespace feroldi::pmr
+#endif
@@ -0,0 +1,522 @@
+// Copyright (c) 2018 Mário Feroldi
+//
+// Distributed under the Boost Software License, Version 1.0.
+// See accompanying file LICENSE or copy at
+// http://www.boost.org/LICENSE_1_0.txt
+
+#ifndef FEROLDI_CXX17_PROFILING_RESOURCE
+#define FEROLDI_CXX17_PROFILING_RESOURCE
+
+#include "memory_resource.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__GNUC__) && __has_include(<unwind.h>)
+#include <unwind.h>
+#define FEROLDI_PMR_UNWIND_BACKTRACE 1
+#endif
+
+namespace feroldi::pmr {
+
+namespace detail {
+
+// Tag given to the allocations the calling thread makes, as set by
+// profiling_tag_scope.
+inline thread_local const char *profiling_tag = nullptr;
+
+// Bytes the calling thread allocates through the profiling resource `owner`
+// before its next sample. Allocating through another one draws a new count
+// for it, which leaves its estimates unbiased, as the distances between
+// samples are memoryless.
+struct profiling_countdown
+{
+  const void *owner = nullptr;
+  std::size_t bytes_left = 0;
+  std::uint64_t random_state = 0; ///< State of a xorshift64* generator.
+};
+
+inline thread_local profiling_countdown profiling_countdown_state;
+
+#if defined(FEROLDI_PMR_UNWIND_BACKTRACE)
+struct backtrace_state
+{
+  void **out;
+  std::size_t max;
+  std::size_t count;
+};
+
+inline _Unwind_Reason_Code backtrace_frame(_Unwind_Context *context,
+                                           void *arg) noexcept
+{
+  auto &state = *static_cast<backtrace_state *>(arg);
+  if (state.count == state.max)
+    return _URC_END_OF_STACK;
+  if (const auto ip = _Unwind_GetIP(context))
+    state.out[state.count++] = reinterpret_cast<void *>(ip);
+  return _URC_NO_REASON;
+}
+#endif
+
+// Stores the return addresses of up to `max` frames of the calling thread's
+// stack in `out`, innermost first, and returns how many were stored. It
+// returns zero where the stack can't be walked.
+inline std::size_t capture_stack(void **out, std::size_t max) noexcept
+{
+#if defined(_WIN32)
+  return CaptureStackBackTrace(
+    1, static_cast<DWORD>(std::min<std::size_t>(max, 62)), out, nullptr);
+#elif defined(FEROLDI_PMR_UNWIND_BACKTRACE)
+  backtrace_state state{out, max, 0};
+  _Unwind_Backtrace(backtrace_frame, &state);
+  return state.count;
+#else
+  (void)out;
+  (void)max;
+  return 0;
+#endif
+}
+
+// Writes protocol buffer messages, with just the encodings a pprof profile
+// uses. Submessages are written by a writer of their own, and then added as
+// a length-delimited field.
+class proto_writer
+{
+public:
+  void varint(std::uint64_t v)
+  {
+    while (v >= 0x80)
+    {
+      out.push_back(static_cast<char>(v | 0x80));
+      v >>= 7;
+    }
+    out.push_back(static_cast<char>(v));
+  }
+
+  // A varint field. Zeros are left out, as they're the default.
+  void field(int number, std::uint64_t v)
+  {
+    if (v == 0)
+      return;
+    varint(static_cast<std::uint64_t>(number) << 3);
+    varint(v);
+  }
+
+  // A length-delimited field: a string, or an encoded submessage.
+  void field(int number, const std::string &bytes)
+  {
+    varint(static_cast<std::uint64_t>(number) << 3 | 2);
+    varint(bytes.size());
+    out += bytes;
+  }
+
+  // A packed repeated varint field.
+  void packed(int number, const std::vector<std::uint64_t> &values)
+  {
+    proto_writer w;
+    for (const auto v : values)
+      w.varint(v);
+    field(number, w.str());
+  }
+
+  const std::string &str() const noexcept { return out; }
+
+private:
+  std::string out;
+};
+
+} // namespace detail
+
+// Tags the allocations the calling thread makes through profiling resources,
+// for as long as it lives, so that they're told apart in the profile by a
+// "tag" label besides their stack. The tag must outlive the profile, like a
+// string literal, as only the pointer is kept; samples with different
+// pointers are different tags.
+class profiling_tag_scope
+{
+public:
+  explicit profiling_tag_scope(const char *tag) noexcept
+    : prev(std::exchange(detail::profiling_tag, tag))
+  {}
+
+  profiling_tag_scope(const profiling_tag_scope &) = delete;
+  profiling_tag_scope &operator=(const profiling_tag_scope &) = delete;
+
+  ~profiling_tag_scope() { detail::profiling_tag = prev; }
+
+private:
+  const char *prev;
+};
+
+struct profiling_options
+{
+  // Mean number of bytes allocated between samples. The distance between
+  // samples is drawn from an exponential distribution of this mean, as in
+  // tcmalloc, so that allocation patterns can't line up with it, and every
+  // byte has the same chance of being sampled. Zero samples every
+  // allocation.
+  std::size_t sample_interval_bytes = 512 * 1024;
+
+  // Most frames of the stack recorded for a sample. Zero records no stacks,
+  // so samples are told apart by their tag alone.
+  std::size_t max_stack_depth = 64;
+};
+
+// Forwards allocations to an upstream memory resource, and samples them to
+// find out which call sites allocate the most bytes through it.
+//
+// Every thread counts down the bytes left until its next sample in a
+// thread_local, so an allocation that isn't sampled costs a subtraction.
+// A sampled one records its stack and tag (see profiling_tag_scope), under a
+// lock, with an estimate of the allocations it stands for. Samples with the
+// same stack and tag are added together, so memory use grows with the number
+// of call sites, not of samples.
+//
+// pprof_profile() encodes the samples as a pprof profile of allocated
+// objects and bytes, which can be viewed with `pprof` or `go tool pprof`.
+// Deallocations aren't tracked, so it's a profile of what was allocated, not
+// of what's live. The innermost frames of every stack are those of the
+// resource itself.
+class profiling_resource : public memory_resource
+{
+public:
+  profiling_resource(const profiling_options &opts, memory_resource *upstream)
+    : upstream(upstream), opts(opts)
+  {
+    assert(upstream);
+  }
+
+  explicit profiling_resource(memory_resource *upstream)
+    : profiling_resource(profiling_options(), upstream)
+  {}
+
+  profiling_resource() : profiling_resource(get_default_resource()) {}
+
+  profiling_resource(const profiling_resource &) = delete;
+  profiling_resource &operator=(const profiling_resource &) = delete;
+
+  memory_resource *upstream_resource() const { return upstream; }
+  profiling_options options() const { return opts; }
+
+  // Number of allocations sampled so far.
+  std::size_t sample_count() const
+  {
+    std::lock_guard<std::mutex> lock(m);
+    return samples_taken;
+  }
+
+  // Discards the samples taken so far.
+  void clear()
+  {
+    std::lock_guard<std::mutex> lock(m);
+    sites.clear();
+    samples_taken = 0;
+  }
+
+  // Encodes the samples taken so far as a pprof profile, an uncompressed
+  // `perftools.profiles.Profile` protocol buffer. On Linux, it lists the
+  // executable mappings of the process, so that pprof can symbolize the
+  // stacks from the binaries they came from.
+  std::string pprof_profile() const
+  {
+    std::map<std::string, std::uint64_t> strings{{std::string(), 0}};
+    std::vector<const std::string *> string_table{&strings.begin()->first};
+    const auto intern = [&](const std::string &s) {
+      const auto inserted = strings.emplace(s, string_table.size());
+      if (inserted.second)
+        string_table.push_back(&inserted.first->first);
+      return inserted.first->second;
+    };
+
+    detail::proto_writer profile;
+    const auto value_type = [&](const char *type, const char *unit) {
+      detail::proto_writer w;
+      w.field(1, intern(type));
+      w.field(2, intern(unit));
+      return w.str();
+    };
+    profile.field(1, value_type("alloc_objects", "count"));
+    profile.field(1, value_type("alloc_space", "bytes"));
+
+    const auto mappings = executable_mappings();
+    for (std::size_t i = 0; i < mappings.size(); ++i)
+    {
+      detail::proto_writer w;
+      w.field(1, i + 1);
+      w.field(2, mappings[i].start);
+      w.field(3, mappings[i].limit);
+      w.field(4, mappings[i].offset);
+      w.field(5, intern(mappings[i].filename));
+      profile.field(3, w.str());
+    }
+
+    std::map<void *, std::uint64_t> locations;
+    {
+      std::lock_guard<std::mutex> lock(m);
+      for (const auto &[key, site] : sites)
+      {
+        detail::proto_writer sample;
+        std::vector<std::uint64_t> location_ids;
+        for (const auto frame : key.second)
+        {
+          const auto id =
+            locations.emplace(frame, locations.size() + 1).first->second;
+          location_ids.push_back(id);
+        }
+        sample.packed(1, location_ids);
+        sample.packed(2, {static_cast<std::uint64_t>(std::llround(site.count)),
+                          static_cast<std::uint64_t>(
+                            std::llround(site.bytes))});
+        if (key.first)
+        {
+          detail::proto_writer label;
+          label.field(1, intern("tag"));
+          label.field(2, intern(key.first));
+          sample.field(3, label.str());
+        }
+        profile.field(2, sample.str());
+      }
+    }
+
+    for (const auto &[frame, id] : locations)
+    {
+      const auto address = reinterpret_cast<std::uintptr_t>(frame);
+      detail::proto_writer w;
+      w.field(1, id);
+      for (std::size_t i = 0; i < mappings.size(); ++i)
+      {
+        if (address >= mappings[i].start && address < mappings[i].limit)
+        {
+          w.field(2, i + 1);
+          break;
+        }
+      }
+      w.field(3, address);
+      profile.field(4, w.str());
+    }
+
+    const auto period_type = value_type("space", "bytes");
+    const auto default_type = intern("alloc_space");
+    for (const auto s : string_table)
+      profile.field(6, *s);
+    profile.field(
+      9, static_cast<std::uint64_t>(
+           std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+             .count()));
+    profile.field(11, period_type);
+    profile.field(12, opts.sample_interval_bytes);
+    profile.field(14, default_type);
+    return profile.str();
+  }
+
+  // Writes pprof_profile() to a file, and returns whether it succeeded.
+  bool write_pprof_profile(const char *path) const
+  {
+    const auto data = pprof_profile();
+    const auto file = std::fopen(path, "wb");
+    if (!file)
+      return false;
+    const bool written =
+      std::fwrite(data.data(), 1, data.size(), file) == data.size();
+    return std::fclose(file) == 0 && written;
+  }
+
+  // Non-virtual versions of `allocate` and `deallocate`, so they can be
+  // inlined when the resource type is known.
+  [[nodiscard]] void *allocate_fast(std::size_t bytes, std::size_t alignment)
+  {
+    auto &c = detail::profiling_countdown_state;
+    if (c.owner == this && bytes < c.bytes_left)
+    {
+      c.bytes_left -= bytes;
+      return upstream->allocate(bytes, alignment);
+    }
+    return allocate_sampled(c, bytes, alignment);
+  }
+
+  void deallocate_fast(void *p, std::size_t bytes, std::size_t alignment)
+  {
+    upstream->deallocate(p, bytes, alignment);
+  }
+
+protected:
+  void *do_allocate(std::size_t bytes, std::size_t alignment) override
+  {
+    return allocate_fast(bytes, alignment);
+  }
+
+  void do_deallocate(void *p, std::size_t bytes,
+                     std::size_t alignment) override
+  {
+    deallocate_fast(p, bytes, alignment);
+  }
+
+  bool do_is_equal(const memory_resource &other) const noexcept override
+  {
+    return this == &other;
+  }
+
+private:
+  // Estimated allocations of a call site, from its samples.
+  struct site_totals
+  {
+    double count = 0;
+    double bytes = 0;
+  };
+
+  // Call sites are told apart by tag and stack.
+  using site_key = std::pair<const char *, std::vector<void *>>;
+
+  struct mapping
+  {
+    std::uint64_t start;
+    std::uint64_t limit;
+    std::uint64_t offset;
+    std::string filename;
+  };
+
+  // Draws the bytes until the next sample from an exponential distribution
+  // whose mean is the sample interval.
+  std::size_t
+  next_sample_distance(detail::profiling_countdown &c) const noexcept
+  {
+    if (opts.sample_interval_bytes == 0)
+      return 0;
+
+    if (c.random_state == 0)
+    {
+      static std::atomic<std::uint64_t> seeds(0x9e3779b97f4a7c15ull);
+      c.random_state =
+        (seeds.fetch_add(0x9e3779b97f4a7c15ull, std::memory_order_relaxed) ^
+         reinterpret_cast<std::uintptr_t>(&c)) |
+        1;
+    }
+
+    auto x = c.random_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    c.random_state = x;
+    // A uniform number in (0, 1], from the top 53 bits.
+    const auto u =
+      static_cast<double>((x * 0x2545f4914f6cdd1dull >> 11) + 1) * 0x1p-53;
+    const auto distance =
+      -std::log(u) * static_cast<double>(opts.sample_interval_bytes);
+    return distance < static_cast<double>(
+                        std::numeric_limits<std::size_t>::max())
+             ? static_cast<std::size_t>(distance) + 1
+             : std::numeric_limits<std::size_t>::max();
+  }
+
+  // Kept out of the fast path, so that allocate_fast stays small enough to be
+  // inlined. It's also where a thread's countdown is taken over from another
+  // resource, in which case the allocation is counted against a new one.
+  void *allocate_sampled(detail::profiling_countdown &c, std::size_t bytes,
+                         std::size_t alignment)
+  {
+    if (c.owner != this)
+    {
+      c.owner = this;
+      c.bytes_left = next_sample_distance(c);
+      if (bytes < c.bytes_left)
+      {
+        c.bytes_left -= bytes;
+        return upstream->allocate(bytes, alignment);
+      }
+    }
+
+    c.bytes_left = next_sample_distance(c);
+    const auto p = upstream->allocate(bytes, alignment);
+
+    // An allocation of `bytes` is sampled with probability 1 - e^(-b/T), so
+    // each sample stands for the inverse of that many allocations.
+    double weight = 1;
+    if (opts.sample_interval_bytes != 0)
+    {
+      const auto probability = -std::expm1(
+        -static_cast<double>(std::max<std::size_t>(bytes, 1)) /
+        static_cast<double>(opts.sample_interval_bytes));
+      weight = 1 / probability;
+    }
+
+    site_key key(detail::profiling_tag, {});
+    if (opts.max_stack_depth != 0)
+    {
+      key.second.resize(opts.max_stack_depth);
+      key.second.resize(
+        detail::capture_stack(key.second.data(), opts.max_stack_depth));
+    }
+
+    try
+    {
+      std::lock_guard<std::mutex> lock(m);
+      auto &site = sites[std::move(key)];
+      site.count += weight;
+      site.bytes += weight * static_cast<double>(bytes);
+      ++samples_taken;
+    }
+    catch (...)
+    {
+      // A sample that can't be recorded doesn't fail the allocation.
+    }
+    return p;
+  }
+
+  // The mappings of the process that hold code, from /proc/self/maps.
+  static std::vector<mapping> executable_mappings()
+  {
+    std::vector<mapping> mappings;
+#if defined(__linux__)
+    if (const auto file = std::fopen("/proc/self/maps", "r"))
+    {
+      char line[4096];
+      while (std::fgets(line, sizeof line, file))
+      {
+        unsigned long long start, limit, offset;
+        char perms[8];
+        int path_pos = 0;
+        if (std::sscanf(line, "%llx-%llx %7s %llx %*s %*s %n", &start, &limit,
+                        perms, &offset, &path_pos) < 4 ||
+            !std::strchr(perms, 'x'))
+          continue;
+        std::string filename(line + path_pos);
+        if (!filename.empty() && filename.back() == '\n')
+          filename.pop_back();
+        mappings.push_back({start, limit, offset, std::move(filename)});
+      }
+      std::fclose(file);
+    }
+#endif
+    return mappings;
+  }
+
+  // Upstream memory resource to which we forward allocations.
+  memory_resource *upstream;
+
+  profiling_options opts;
+  mutable std::mutex m; ///< Guards the samples.
+  std::map<site_key, site_totals> sites; ///< Samples by call site.
+  std::size_t samples_taken = 0; ///< Number of samples.
+};
+
+} // namespace feroldi::pmr
+#endif
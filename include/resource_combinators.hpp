@@ -0,0 +1,337 @@
+// Copyright (c) 2018 Mário Feroldi
+//
+// Distributed under the Boost Software License, Version 1.0.
+// See accompanying file LICENSE or copy at
+// http://www.boost.org/LICENSE_1_0.txt
+
+#ifndef FEROLDI_CXX17_RESOURCE_COMBINATORS
+#define FEROLDI_CXX17_RESOURCE_COMBINATORS
+
+#include "memory_resource.hpp"
+
+#include <cassert>
+#include <cstddef>
+#include <new>
+#include <optional>
+#include <tuple>
+#include <utility>
+
+// Memory resources made of other resources, in the style of Alexandrescu's
+// allocator building blocks. Components are given as concrete types and are
+// owned by the resource made of them, so that routing a request to them is a
+// direct, inlinable call to their `allocate_fast`/`deallocate_fast`, when
+// they have them, rather than a virtual one. Only the outermost resource is
+// called through the memory_resource interface.
+//
+// Components that are constructed with arguments are given them as tuples,
+// after `std::piecewise_construct`, as in std::pair.
+
+namespace feroldi::pmr {
+
+namespace detail {
+
+template <class Resource>
+void *allocate_from(Resource &r, std::size_t bytes, std::size_t alignment)
+{
+  if constexpr (has_fast_path_v<Resource>)
+    return r.allocate_fast(bytes, alignment);
+  else
+    return r.allocate(bytes, alignment);
+}
+
+template <class Resource>
+void deallocate_to(Resource &r, void *p, std::size_t bytes,
+                   std::size_t alignment)
+{
+  if constexpr (has_fast_path_v<Resource>)
+    r.deallocate_fast(p, bytes, alignment);
+  else
+    r.deallocate(p, bytes, alignment);
+}
+
+// Constructs a `T` from the elements of a tuple.
+template <class T, class Tuple, std::size_t... I>
+T *construct_from_tuple(std::optional<T> &storage, Tuple &&args,
+                        std::index_sequence<I...>)
+{
+  return &storage.emplace(std::get<I>(std::forward<Tuple>(args))...);
+}
+
+template <class T, class... Args>
+T *construct_from_tuple(std::optional<T> &storage, std::tuple<Args...> &&args)
+{
+  return construct_from_tuple(storage, std::move(args),
+                              std::index_sequence_for<Args...>());
+}
+
+} // namespace detail
+
+// A component which refers to a resource that it doesn't own, such as
+// new_delete_resource(), and calls it through the memory_resource interface.
+class resource_ref
+{
+public:
+  resource_ref() noexcept : res(get_default_resource()) {}
+  resource_ref(memory_resource *r) noexcept : res(r) { assert(r); }
+
+  memory_resource *resource() const noexcept { return res; }
+
+  [[nodiscard]] void *allocate_fast(std::size_t bytes, std::size_t alignment)
+  {
+    return res->allocate(bytes, alignment);
+  }
+
+  void deallocate_fast(void *p, std::size_t bytes, std::size_t alignment)
+  {
+    res->deallocate(p, bytes, alignment);
+  }
+
+private:
+  memory_resource *res;
+};
+
+// Allocates from `Primary`, and from `Fallback` when `Primary` throws, such
+// as an inline_buffer_resource whose upstream is null_memory_resource().
+// Deallocations go to `Primary` if its `owns(p)` says the memory is its own,
+// and to `Fallback` otherwise.
+template <class Primary, class Fallback>
+class fallback_resource : public memory_resource
+{
+public:
+  fallback_resource()
+    : fallback_resource(std::piecewise_construct, std::tuple<>(),
+                        std::tuple<>())
+  {}
+
+  template <class... PrimaryArgs, class... FallbackArgs>
+  fallback_resource(std::piecewise_construct_t,
+                    std::tuple<PrimaryArgs...> primary_args,
+                    std::tuple<FallbackArgs...> fallback_args)
+  {
+    detail::construct_from_tuple(primary_res, std::move(primary_args));
+    detail::construct_from_tuple(fallback_res, std::move(fallback_args));
+  }
+
+  fallback_resource(const fallback_resource &) = delete;
+  fallback_resource &operator=(const fallback_resource &) = delete;
+
+  Primary &primary() noexcept { return *primary_res; }
+  Fallback &fallback() noexcept { return *fallback_res; }
+
+  [[nodiscard]] void *allocate_fast(std::size_t bytes, std::size_t alignment)
+  {
+    try
+    {
+      return detail::allocate_from(*primary_res, bytes, alignment);
+    }
+    catch (const std::bad_alloc &)
+    {
+      return detail::allocate_from(*fallback_res, bytes, alignment);
+    }
+  }
+
+  void deallocate_fast(void *p, std::size_t bytes, std::size_t alignment)
+  {
+    if (primary_res->owns(p))
+      detail::deallocate_to(*primary_res, p, bytes, alignment);
+    else
+      detail::deallocate_to(*fallback_res, p, bytes, alignment);
+  }
+
+  // Only available if both components have it.
+  bool owns(const void *p) const noexcept
+  {
+    return primary_res->owns(p) || fallback_res->owns(p);
+  }
+
+protected:
+  void *do_allocate(std::size_t bytes, std::size_t alignment) override
+  {
+    return allocate_fast(bytes, alignment);
+  }
+
+  void do_deallocate(void *p, std::size_t bytes,
+                     std::size_t alignment) override
+  {
+    deallocate_fast(p, bytes, alignment);
+  }
+
+  bool do_is_equal(const memory_resource &other) const noexcept override
+  {
+    return this == &other;
+  }
+
+private:
+  // Components are held in optionals so that they're constructed in place,
+  // as resources can't be copied nor moved.
+  std::optional<Primary> primary_res;
+  std::optional<Fallback> fallback_res;
+};
+
+// Sends requests of up to `Threshold` bytes to `Small`, and larger ones to
+// `Large`. Deallocations are routed by their size the same way, so neither
+// component has to tell whether it owns the memory.
+template <std::size_t Threshold, class Small, class Large>
+class segregator_resource : public memory_resource
+{
+public:
+  static constexpr std::size_t threshold = Threshold;
+
+  segregator_resource()
+    : segregator_resource(std::piecewise_construct, std::tuple<>(),
+                          std::tuple<>())
+  {}
+
+  template <class... SmallArgs, class... LargeArgs>
+  segregator_resource(std::piecewise_construct_t,
+                      std::tuple<SmallArgs...> small_args,
+                      std::tuple<LargeArgs...> large_args)
+  {
+    detail::construct_from_tuple(small_res, std::move(small_args));
+    detail::construct_from_tuple(large_res, std::move(large_args));
+  }
+
+  segregator_resource(const segregator_resource &) = delete;
+  segregator_resource &operator=(const segregator_resource &) = delete;
+
+  Small &small() noexcept { return *small_res; }
+  Large &large() noexcept { return *large_res; }
+
+  [[nodiscard]] void *allocate_fast(std::size_t bytes, std::size_t alignment)
+  {
+    if (bytes <= Threshold)
+      return detail::allocate_from(*small_res, bytes, alignment);
+    return detail::allocate_from(*large_res, bytes, alignment);
+  }
+
+  void deallocate_fast(void *p, std::size_t bytes, std::size_t alignment)
+  {
+    if (bytes <= Threshold)
+      detail::deallocate_to(*small_res, p, bytes, alignment);
+    else
+      detail::deallocate_to(*large_res, p, bytes, alignment);
+  }
+
+  // Only available if both components have it.
+  bool owns(const void *p) const noexcept
+  {
+    return small_res->owns(p) || large_res->owns(p);
+  }
+
+protected:
+  void *do_allocate(std::size_t bytes, std::size_t alignment) override
+  {
+    return allocate_fast(bytes, alignment);
+  }
+
+  void do_deallocate(void *p, std::size_t bytes,
+                     std::size_t alignment) override
+  {
+    deallocate_fast(p, bytes, alignment);
+  }
+
+  bool do_is_equal(const memory_resource &other) const noexcept override
+  {
+    return this == &other;
+  }
+
+private:
+  std::optional<Small> small_res;
+  std::optional<Large> large_res;
+};
+
+// Has a `Resource` for every `Step` bytes of request sizes in `(Min, Max]`,
+// and sends each request to the resource of its size, rounded up to the top
+// of its bucket, so that each resource sees a single size. Requests outside
+// of the range throw std::bad_alloc, as with null_memory_resource(), which
+// is why it's meant to be the small side of a segregator_resource whose
+// threshold is `Max`.
+template <class Resource, std::size_t Min, std::size_t Max, std::size_t Step>
+class bucketizer : public memory_resource
+{
+  static_assert(Step > 0, "buckets can't be empty");
+  static_assert(Min < Max && (Max - Min) % Step == 0,
+                "the range must be a whole number of buckets");
+
+public:
+  static constexpr std::size_t bucket_count = (Max - Min) / Step;
+
+  // Every bucket's resource is constructed from `args`.
+  template <class... Args>
+  explicit bucketizer(const Args &... args)
+  {
+    for (auto &bucket : buckets)
+      bucket.emplace(args...);
+  }
+
+  bucketizer(const bucketizer &) = delete;
+  bucketizer &operator=(const bucketizer &) = delete;
+
+  Resource &bucket(std::size_t index) noexcept
+  {
+    assert(index < bucket_count);
+    return *buckets[index];
+  }
+
+  // Index of the bucket serving requests of `bytes`, or `bucket_count` if
+  // it's out of range.
+  static constexpr std::size_t bucket_index(std::size_t bytes) noexcept
+  {
+    if (bytes <= Min || bytes > Max)
+      return bucket_count;
+    return (bytes - Min - 1) / Step;
+  }
+
+  [[nodiscard]] void *allocate_fast(std::size_t bytes, std::size_t alignment)
+  {
+    const auto index = bucket_index(bytes);
+    if (index == bucket_count)
+      throw std::bad_alloc();
+    return detail::allocate_from(*buckets[index], bucket_size(index),
+                                 alignment);
+  }
+
+  void deallocate_fast(void *p, std::size_t bytes, std::size_t alignment)
+  {
+    const auto index = bucket_index(bytes);
+    assert(index < bucket_count);
+    detail::deallocate_to(*buckets[index], p, bucket_size(index), alignment);
+  }
+
+  // Only available if the buckets' resources have it.
+  bool owns(const void *p) const noexcept
+  {
+    for (const auto &bucket : buckets)
+      if (bucket->owns(p))
+        return true;
+    return false;
+  }
+
+protected:
+  void *do_allocate(std::size_t bytes, std::size_t alignment) override
+  {
+    return allocate_fast(bytes, alignment);
+  }
+
+  void do_deallocate(void *p, std::size_t bytes,
+                     std::size_t alignment) override
+  {
+    deallocate_fast(p, bytes, alignment);
+  }
+
+  bool do_is_equal(const memory_resource &other) const noexcept override
+  {
+    return this == &other;
+  }
+
+private:
+  static constexpr std::size_t bucket_size(std::size_t index) noexcept
+  {
+    return Min + (index + 1) * Step;
+  }
+
+  std::optional<Resource> buckets[bucket_count];
+};
+
+} // namespace feroldi::pmr
+#endif
@@ -0,0 +1,284 @@
+// Copyright (c) 2018 Mário Feroldi
+//
+// Distributed under the Boost Software License, Version 1.0.
+// See accompanying file LICENSE or copy at
+// http://www.boost.org/LICENSE_1_0.txt
+
+#ifndef FEROLDI_CXX17_SMALL_CONTAINERS
+#define FEROLDI_CXX17_SMALL_CONTAINERS
+
+#include "memory_resource.hpp"
+#include "monotonic_vector.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <initializer_list>
+#include <iterator>
+#include <string>
+#include <string_view>
+
+namespace feroldi::pmr {
+
+namespace detail {
+
+constexpr std::size_t inline_alignment(std::size_t alignment) noexcept
+{
+  return std::max(alignment, alignof(std::max_align_t));
+}
+
+// The inline_buffer_resource of a small container, in a base class of its
+// own, so that it exists before the container base is given it. It's not a
+// resource itself, so that containers don't compare as resources.
+template <std::size_t Size, std::size_t Align>
+struct inline_resource_base
+{
+  explicit inline_resource_base(memory_resource *upstream)
+    : inline_resource(upstream)
+  {}
+
+  inline_buffer_resource<Size, inline_alignment(Align)> inline_resource;
+};
+
+} // namespace detail
+
+// A monotonic_vector with room for `N` elements inside of it, in an
+// inline_buffer_resource, so that it doesn't allocate from upstream unless
+// it grows past them.
+//
+// Copies, moves and swaps go element by element, since the elements may live
+// in the other vector's buffer. The monotonic_vector it's built on isn't a
+// public base, as moving or swapping through it would take the storage.
+template <class T, std::size_t N>
+class small_vector
+  : private detail::inline_resource_base<N * sizeof(T), alignof(T)>
+  , private monotonic_vector<T>
+{
+  using resource_base = detail::inline_resource_base<N * sizeof(T), alignof(T)>;
+  using vector_type = monotonic_vector<T>;
+
+public:
+  using typename vector_type::value_type;
+  using typename vector_type::size_type;
+  using typename vector_type::difference_type;
+  using typename vector_type::reference;
+  using typename vector_type::const_reference;
+  using typename vector_type::pointer;
+  using typename vector_type::const_pointer;
+  using typename vector_type::iterator;
+  using typename vector_type::const_iterator;
+  using typename vector_type::reverse_iterator;
+  using typename vector_type::const_reverse_iterator;
+
+  using vector_type::assign;
+  using vector_type::back;
+  using vector_type::begin;
+  using vector_type::capacity;
+  using vector_type::cbegin;
+  using vector_type::cend;
+  using vector_type::clear;
+  using vector_type::data;
+  using vector_type::emplace;
+  using vector_type::emplace_back;
+  using vector_type::empty;
+  using vector_type::end;
+  using vector_type::erase;
+  using vector_type::front;
+  using vector_type::insert;
+  using vector_type::operator[];
+  using vector_type::pop_back;
+  using vector_type::push_back;
+  using vector_type::rbegin;
+  using vector_type::rend;
+  using vector_type::reserve;
+  using vector_type::resize;
+  using vector_type::resource;
+  using vector_type::shrink_to_fit;
+  using vector_type::size;
+
+  static constexpr std::size_t inline_capacity = N;
+
+  small_vector() : small_vector(get_default_resource()) {}
+
+  explicit small_vector(memory_resource *upstream)
+    : resource_base(upstream), vector_type(&this->inline_resource)
+  {
+    this->reserve(N);
+  }
+
+  small_vector(std::initializer_list<T> init,
+               memory_resource *upstream = get_default_resource())
+    : small_vector(init.begin(), init.end(), upstream)
+  {}
+
+  template <class InputIt,
+            class = typename std::iterator_traits<InputIt>::iterator_category>
+  small_vector(InputIt first, InputIt last,
+               memory_resource *upstream = get_default_resource())
+    : small_vector(upstream)
+  {
+    this->assign(first, last);
+  }
+
+  small_vector(const small_vector &other)
+    : small_vector(other.begin(), other.end(), other.upstream_resource())
+  {}
+
+  small_vector(small_vector &&other)
+    : small_vector(std::make_move_iterator(other.begin()),
+                   std::make_move_iterator(other.end()),
+                   other.upstream_resource())
+  {}
+
+  small_vector &operator=(const small_vector &other)
+  {
+    vector_type::operator=(other);
+    return *this;
+  }
+
+  small_vector &operator=(small_vector &&other)
+  {
+    vector_type::operator=(std::move(other));
+    return *this;
+  }
+
+  void swap(small_vector &other)
+  {
+    if (this == &other)
+      return;
+    small_vector tmp(std::move(*this));
+    *this = std::move(other);
+    other = std::move(tmp);
+  }
+
+  friend void swap(small_vector &a, small_vector &b) { a.swap(b); }
+
+  friend bool operator==(const small_vector &a, const small_vector &b)
+  {
+    return std::equal(a.begin(), a.end(), b.begin(), b.end());
+  }
+
+  friend bool operator!=(const small_vector &a, const small_vector &b)
+  {
+    return !(a == b);
+  }
+
+  // Whether `p` points into the container's own buffer.
+  bool is_inline(const void *p) const noexcept
+  {
+    return this->inline_resource.is_inline(p);
+  }
+
+  memory_resource *upstream_resource() const
+  {
+    return this->inline_resource.upstream_resource();
+  }
+};
+
+// A std::basic_string with room for `N` characters, including the
+// terminator, inside of it, in an inline_buffer_resource, so that it doesn't
+// allocate from upstream unless it grows past them.
+//
+// Copies, moves and swaps go character by character, since the characters
+// may live in the other string's buffer, so it mustn't be swapped as a
+// std::basic_string, whose swap would exchange the buffers' allocators.
+// Memory the string leaves behind as it grows isn't reused until it's
+// destroyed, as with any monotonic resource.
+template <class CharT, std::size_t N, class Traits = std::char_traits<CharT>>
+class basic_small_string
+  : private detail::inline_resource_base<N * sizeof(CharT), alignof(CharT)>
+  , public std::basic_string<CharT, Traits, polymorphic_allocator<CharT>>
+{
+  using resource_base =
+    detail::inline_resource_base<N * sizeof(CharT), alignof(CharT)>;
+  using string_type =
+    std::basic_string<CharT, Traits, polymorphic_allocator<CharT>>;
+
+public:
+  static constexpr std::size_t inline_capacity = N;
+
+  basic_small_string() : basic_small_string(get_default_resource()) {}
+
+  explicit basic_small_string(memory_resource *upstream)
+    : resource_base(upstream)
+    , string_type(N - 1, CharT(),
+                  polymorphic_allocator<CharT>(&this->inline_resource))
+  {
+    // The string is made `N - 1` characters long and cleared, rather than
+    // reserved, because reserve() may round the capacity up past the buffer.
+    // If they fit in the string's own small buffer, nothing is allocated.
+    this->clear();
+  }
+
+  basic_small_string(std::basic_string_view<CharT, Traits> s,
+                     memory_resource *upstream = get_default_resource())
+    : basic_small_string(upstream)
+  {
+    this->assign(s.data(), s.size());
+  }
+
+  basic_small_string(const CharT *s,
+                     memory_resource *upstream = get_default_resource())
+    : basic_small_string(std::basic_string_view<CharT, Traits>(s), upstream)
+  {}
+
+  basic_small_string(const basic_small_string &other)
+    : basic_small_string(other.view(), other.upstream_resource())
+  {}
+
+  basic_small_string(basic_small_string &&other)
+    : basic_small_string(other.view(), other.upstream_resource())
+  {}
+
+  basic_small_string &operator=(const basic_small_string &other)
+  {
+    this->assign(other.data(), other.size());
+    return *this;
+  }
+
+  basic_small_string &operator=(basic_small_string &&other)
+  {
+    this->assign(other.data(), other.size());
+    return *this;
+  }
+
+  using string_type::operator=;
+
+  void swap(basic_small_string &other)
+  {
+    if (this == &other)
+      return;
+    basic_small_string tmp(std::move(*this));
+    *this = std::move(other);
+    other = std::move(tmp);
+  }
+
+  friend void swap(basic_small_string &a, basic_small_string &b)
+  {
+    a.swap(b);
+  }
+
+  std::basic_string_view<CharT, Traits> view() const noexcept
+  {
+    return {this->data(), this->size()};
+  }
+
+  // Whether `p` points into the container's own buffer.
+  bool is_inline(const void *p) const noexcept
+  {
+    return this->inline_resource.is_inline(p);
+  }
+
+  memory_resource *upstream_resource() const
+  {
+    return this->inline_resource.upstream_resource();
+  }
+};
+
+template <std::size_t N>
+using small_string = basic_small_string<char, N>;
+
+template <std::size_t N>
+using small_wstring = basic_small_string<wchar_t, N>;
+
+} // namespace feroldi::pmr
+#endif